@@ -0,0 +1,189 @@
+#!/bin/sh
+# worker of the queue of example_post-receive.sh: writes the pages of the
+# repositories with queued pushes.
+# change the config options below, they must match the ones of
+# example_post-receive.sh.
+#
+# usage: $0
+#
+# the queue is a spool directory:
+# - new/name/id: the updated refs of a push to repository name, "old new ref"
+#   lines. the pushes to a repository that are queued when it is processed
+#   are written in one run of stagit. they are removed when stagit succeeds,
+#   else they stay queued until the next worker.
+# - lock/name: locked while repository name is processed, a repository that
+#   is locked by another process is left in the queue.
+# - worker.lock: locked while a worker runs, only one worker runs at a time.
+# - failed: the repositories of which stagit failed in the last worker.
+# the locks are taken with flock(1): a lock is released when the process
+# that holds it exits, also when it crashes, so there are no stale locks.
+
+# NOTE: needs to be set for correct locale (expects UTF-8) otherwise the
+#       default is LC_CTYPE="POSIX".
+export LC_CTYPE="en_US.UTF-8"
+
+# config
+# paths must be absolute.
+reposdir="/home/src/src"
+htmldir="/home/www/domains/git.codemadness.org/htdocs"
+stagitdir="/"
+destdir="${htmldir}${stagitdir}"
+cachefile=".htmlcache"
+spooldir="/var/spool/stagit"
+# maximum number of repositories that are processed at the same time.
+maxjobs=4
+# /config
+
+# is lock file $1 held by another process.
+locked() {
+	! flock -n "$1" true 2>/dev/null
+}
+
+# write the pages of a repository with the queued pushes, the repository is
+# locked by the caller.
+process() {
+	name="$1"
+
+	# take the pushes that are queued now, later ones stay queued.
+	updates=""
+	files=""
+	for f in "${spooldir}/new/${name}/"*; do
+		test -f "${f}" || continue
+		updates="${updates}$(cat "${f}")
+"
+		files="${files}${f}
+"
+	done
+
+	if test -n "${updates}"; then
+		if generate "${name}" "${updates}"; then
+			printf '%s' "${files}" | while read -r f; do
+				rm -f "${f}"
+			done
+		else
+			echo "${name}" >> "${spooldir}/failed"
+		fi
+	fi
+}
+
+# has repository $1 failed in this worker.
+failed() {
+	grep -Fqx "$1" "${spooldir}/failed" 2>/dev/null
+}
+
+# is a repository with queued pushes that is not locked and did not fail.
+pending() {
+	for d in "${spooldir}/new/"*/; do
+		test -d "${d}" || continue
+		name=$(basename "${d}")
+		locked "${spooldir}/lock/${name}" && continue
+		failed "${name}" && continue
+		for f in "${d}"*; do
+			test -f "${f}" && return 0
+		done
+	done
+	return 1
+}
+
+# generate the pages of repository $1 with the updated refs $2.
+generate() {
+	name="$1"
+	updates="$2"
+	dir="${reposdir}/${name}"
+
+	if ! test -d "${dir}"; then
+		echo "${dir} does not exist" >&2
+		return 1
+	fi
+	cd "${dir}" || return 1
+
+	# detect git push -f
+	force=0
+	while read -r old new ref; do
+		test "${old}" = "0000000000000000000000000000000000000000" && continue
+		test "${new}" = "0000000000000000000000000000000000000000" && continue
+
+		hasrevs=$(git rev-list "${old}" "^${new}" 2>/dev/null | sed 1q)
+		if test -n "${hasrevs}"; then
+			force=1
+			break
+		fi
+	done <<EOF
+${updates}
+EOF
+
+	# strip .git suffix.
+	r=$(basename "${name}")
+	d=$(basename "${name}" ".git")
+	printf "[%s] stagit HTML pages... " "${d}"
+
+	mkdir -p "${destdir}/${d}"
+	cd "${destdir}/${d}" || return 1
+
+	# remove commits and ${cachefile} on git push -f, this recreated later on.
+	if test "${force}" = "1"; then
+		rm -f "${cachefile}"
+		rm -rf "commit"
+	fi
+
+	# make pages, on git push -f all of them, else only of the updated refs.
+	if test "${force}" = "1"; then
+		stagit -c "${cachefile}" "${reposdir}/${r}"
+	else
+		printf '%s' "${updates}" | stagit -u -c "${cachefile}" "${reposdir}/${r}"
+	fi
+	status=$?
+
+	ln -sf log.html index.html
+	ln -sf ../style.css style.css
+	ln -sf ../logo.png logo.png
+
+	if test "${status}" = "0"; then
+		echo "done"
+	else
+		echo "failed"
+	fi
+	return "${status}"
+}
+
+mkdir -p "${spooldir}/new" "${spooldir}/lock" || exit 1
+exec 8> "${spooldir}/worker.lock" || exit 1
+flock -n 8 || exit 0
+rm -f "${spooldir}/failed"
+
+# in rounds of at most ${maxjobs} repositories until the queue is empty.
+while pending; do
+	n=0
+	for d in "${spooldir}/new/"*/; do
+		test -d "${d}" || continue
+		name=$(basename "${d}")
+		failed "${name}" && continue
+		locked "${spooldir}/lock/${name}" && continue
+
+		# the job holds the lock of the repository, not the one of the
+		# worker.
+		(
+			exec 9> "${spooldir}/lock/${name}" || exit 1
+			flock -n 9 || exit 0
+			process "${name}"
+		) 8>&- &
+		n=$((n + 1))
+		if test "${n}" -ge "${maxjobs}"; then
+			wait
+			n=0
+		fi
+	done
+	wait
+
+	# make index.
+	stagit-index "${reposdir}/"*/ > "${destdir}/index.html"
+done
+
+# pushes that were queued after the last round, while their worker exited
+# because this one was running: the lock is released first, so a push that
+# is queued after the check below starts a worker that gets it. the pushes
+# of failed repositories are left to the next push.
+exec 8>&-
+if pending; then
+	exec sh "$0"
+fi
@@ -0,0 +1,237 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compat.h"
+
+static const char *archive;
+static char *idx;    /* mapped "<archive>.idx" */
+static size_t indexlen;
+static size_t entries; /* offset of the first entry line in the index */
+static int datafd = -1;
+
+struct entry {
+	off_t off;
+	size_t len;
+	const char *path;
+	size_t pathlen;
+};
+
+/* parse the index line at p, returns the start of the next line */
+size_t
+parseline(size_t p, struct entry *e)
+{
+	const char *s = idx + p, *end = idx + indexlen;
+	char *ep;
+
+	e->off = strtoll(s, &ep, 10);
+	e->len = strtoull(ep + 1, &ep, 10);
+	e->path = ep + 1;
+	for (s = e->path; s < end && *s != '\n'; s++)
+		;
+	e->pathlen = s - e->path;
+
+	return s - idx + (s < end);
+}
+
+int
+pathcmp(const struct entry *e, const char *path)
+{
+	size_t len = strlen(path);
+	int r;
+
+	if ((r = memcmp(e->path, path, e->pathlen < len ? e->pathlen : len)))
+		return r;
+	return e->pathlen < len ? -1 : e->pathlen > len;
+}
+
+/* binary search of the sorted lines of the index */
+int
+findentry(const char *path, struct entry *e)
+{
+	size_t lo = entries, hi = indexlen, mid, p, next;
+	int r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		/* the start of the line of mid */
+		for (p = mid; p > lo && idx[p - 1] != '\n'; p--)
+			;
+		next = parseline(p, e);
+		if (!(r = pathcmp(e, path)))
+			return 0;
+		if (r < 0)
+			lo = next;
+		else
+			hi = p;
+	}
+
+	return -1;
+}
+
+void
+openarchive(void)
+{
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned gen;
+	int fd, r;
+
+	r = snprintf(path, sizeof(path), "%s.idx", archive);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: '%s.idx'", archive);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "open: '%s'", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "fstat: '%s'", path);
+	if (!(indexlen = st.st_size))
+		errx(1, "%s: empty index", path);
+	if ((idx = mmap(NULL, indexlen, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		err(1, "mmap: '%s'", path);
+	close(fd);
+
+	/* first line: the number of the data file */
+	for (gen = 0, entries = 0; entries < indexlen && idx[entries] != '\n'; entries++) {
+		if (idx[entries] < '0' || idx[entries] > '9')
+			errx(1, "%s: invalid index", path);
+		gen = gen * 10 + (idx[entries] - '0');
+	}
+	if (entries++ == indexlen)
+		errx(1, "%s: invalid index", path);
+
+	r = snprintf(path, sizeof(path), "%s.%u.pack", archive, gen);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: '%s.%u.pack'", archive, gen);
+	if ((datafd = open(path, O_RDONLY)) == -1)
+		err(1, "open: '%s'", path);
+}
+
+/* write the data of the entry to stdout */
+int
+writeentry(const struct entry *e)
+{
+	char buf[BUFSIZ];
+	size_t len, n;
+	off_t off;
+	ssize_t r;
+
+	for (off = e->off, len = e->len; len > 0; off += r, len -= r) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if ((r = pread(datafd, buf, n, off)) == -1) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (r == 0 || fwrite(buf, 1, r, stdout) != (size_t)r)
+			return -1;
+	}
+
+	return 0;
+}
+
+const char *
+contenttype(const char *path)
+{
+	const char *p;
+
+	if (!(p = strrchr(path, '.')))
+		return "application/octet-stream";
+	if (!strcmp(p, ".html"))
+		return "text/html; charset=UTF-8";
+	if (!strcmp(p, ".xml"))
+		return "application/atom+xml";
+	if (!strcmp(p, ".txt"))
+		return "text/plain; charset=UTF-8";
+
+	return "application/octet-stream";
+}
+
+/* CGI: serve the page of PATH_INFO */
+int
+cgi(void)
+{
+	struct entry e;
+	const char *path;
+
+	if (!(path = getenv("PATH_INFO")))
+		path = "";
+	while (*path == '/')
+		path++;
+	if (!*path || !strcmp(path, "index.html"))
+		path = "log.html";
+
+	if (findentry(path, &e)) {
+		fputs("Status: 404 Not Found\r\n"
+		      "Content-Type: text/plain; charset=UTF-8\r\n\r\n"
+		      "Not Found\n", stdout);
+		return 0;
+	}
+	printf("Content-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+	       contenttype(path), e.len);
+	if (writeentry(&e))
+		err(1, "write: '%s'", path);
+
+	return 0;
+}
+
+void
+usage(char *argv0)
+{
+	fprintf(stderr, "%s archive [path...]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct entry e;
+	size_t p;
+	int i, ret = 0;
+
+	if (argc < 2)
+		usage(argv[0]);
+	archive = argv[1];
+
+#ifdef __OpenBSD__
+	if (pledge("stdio rpath", NULL) == -1)
+		err(1, "pledge");
+#endif
+
+	openarchive();
+
+	if (getenv("GATEWAY_INTERFACE"))
+		return cgi();
+
+	/* list the paths of the pages */
+	if (argc == 2) {
+		for (p = entries; p < indexlen; ) {
+			p = parseline(p, &e);
+			printf("%.*s\n", (int)e.pathlen, e.path);
+		}
+		return 0;
+	}
+
+	for (i = 2; i < argc; i++) {
+		if (findentry(argv[i], &e)) {
+			warnx("%s: not found", argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (writeentry(&e))
+			err(1, "write: '%s'", argv[i]);
+	}
+
+	return ret;
+}
@@ -1,10 +1,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +19,13 @@
 #include <unistd.h>
 
 #include <git2.h>
+#include <zlib.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "compat.h"
 
@@ -21,6 +34,25 @@ struct deltainfo {
 
 	size_t addcount;
 	size_t delcount;
+	size_t bytes; /* of the lines of the patch */
+	const char *over; /* "file" or "commit": over its limit, not shown */
+	size_t minbytes;  /* over a limit by the sizes of its blobs: no patch */
+	int split;    /* written to a page of its own, see writediffpages() */
+};
+
+/* arena: allocations that are freed at once, see arena_alloc() */
+struct arenachunk {
+	struct arenachunk *next;
+	size_t len;
+	size_t cap;
+	char *data;
+};
+
+struct arena {
+	struct arenachunk *chunks; /* current chunk first */
+	struct arenachunk *free;   /* chunks for reuse after a reset */
+	size_t nallocs;            /* allocations since the last reset */
+	size_t nheap;              /* chunks allocated since the last reset */
 };
 
 struct commitinfo {
@@ -43,15 +75,81 @@ struct commitinfo {
 	size_t addcount;
 	size_t delcount;
 	size_t filecount;
+	size_t renamepairs; /* set when rename detection was skipped */
 
 	struct deltainfo **deltas;
 	size_t ndeltas;
+
+	struct arena *arena; /* of the commitinfo and its deltas, reset when freed */
+};
+
+/* output file: rendered in memory and only replaced when its content changed */
+struct output {
+	FILE *fp;
+	char *buf;
+	size_t len;
+	char path[PATH_MAX];
+};
+
+/* hash set of object ids */
+struct oidsetentry {
+	git_oid id;
+	size_t key; /* of the inputs of a commit page, see commitpagekey() */
+	int used;
+	int seen;
+};
+
+struct oidset {
+	struct oidsetentry *entries;
+	size_t n;
+	size_t cap; /* power of 2 */
+};
+
+/* hash table with string keys */
+struct strtabentry {
+	char *key;
+	void *data;
+};
+
+struct strtab {
+	struct strtabentry *entries;
+	size_t n;
+	size_t cap; /* power of 2 */
+};
+
+/* file history: commits that changed a path, newest first */
+struct pathcommit {
+	size_t commit; /* index in histcommits */
+	size_t addcount;
+	size_t delcount;
+};
+
+struct pathhist {
+	struct pathcommit *commits;
+	size_t ncommits;
+	size_t cap;
+	int changed; /* changed by a commit of this run */
+};
+
+/* search index: document of a commit and the documents of a term */
+struct searchdoc {
+	char oid[GIT_OID_HEXSZ + 1];
+	git_time when;
+	char *author;
+	char *summary;
+};
+
+struct postings {
+	size_t *docs; /* in walk order, see search_addcommit() */
+	size_t ndocs;
+	size_t cap;
 };
 
 /* reference and associated data for sorting */
 struct referenceinfo {
 	struct git_reference *ref;
 	struct commitinfo *ci;
+	int archive; /* of the tag is written (-z) */
 };
 
 static git_repository *repo;
@@ -69,6 +167,170 @@ static char *license;
 static char *readmefiles[] = { "HEAD:README", "HEAD:README.md" };
 static char *readme;
 static long long nlogcommits = -1; /* < 0 indicates not used */
+static int verbose;
+
+/* limits, can be changed with -o name=value, 0 means no limit */
+static long long maxblobbytes = 10485760; /* bytes rendered per blob page */
+static long long maxbloblines = 100000;   /* lines rendered per blob page */
+static long long renames = -1;            /* 0: off, -1: exact, 1-100: similarity */
+static long long renamelimit = 1000000;   /* candidate pairs per commit */
+static long long streamdiff = 1;          /* generate one patch at a time */
+static long long uringdepth = 64;         /* files written at once with io_uring */
+static long long packcompact = 50;        /* unused percent of an archive */
+static long long reportsize = 20;         /* commits and blobs in the report */
+static long long difffiles = 1000;        /* files of a commit with a diff */
+static long long difflines = 10000;       /* changed lines rendered per file */
+static long long diffbytes = 1048576;     /* bytes of the patch rendered per file */
+static long long commitlines = 100000;    /* changed lines rendered per commit */
+static long long commitbytes = 10485760;  /* bytes of the patches rendered per commit */
+static long long splitdiff = 0;           /* bytes of a patch written to its own page */
+static long long jobs = 0;                /* threads, 0: one per processor */
+static long long blametime = 60;          /* seconds of blame per run (-B) */
+
+struct tunable {
+	const char *name;
+	long long *value;
+};
+
+static const struct tunable tunables[] = {
+	{ "blobbytes", &maxblobbytes },
+	{ "bloblines", &maxbloblines },
+	{ "renames",   &renames },
+	{ "renamelimit", &renamelimit },
+	{ "streamdiff", &streamdiff },
+	{ "uring", &uringdepth },
+	{ "compact", &packcompact },
+	{ "report", &reportsize },
+	{ "difffiles", &difffiles },
+	{ "difflines", &difflines },
+	{ "diffbytes", &diffbytes },
+	{ "commitlines", &commitlines },
+	{ "commitbytes", &commitbytes },
+	{ "splitdiff", &splitdiff },
+	{ "jobs", &jobs },
+	{ "blametime", &blametime },
+};
+
+/* allocations of the diffstat of the current commit */
+#define ARENACHUNKSIZ 65536
+static size_t arenacommits, arenaallocs, arenaheap, arenamaxallocs;
+
+/* tree pages: a page per directory of its direct entries, see -T */
+#define PAGEVERSION 1 /* changes when the rendering of the pages changes */
+struct pageinfo {
+	git_oid id;     /* object the page was rendered from */
+	int lc;         /* lines of a blob */
+	git_off_t size; /* size of a blob */
+};
+static int treepages;
+static struct strtab pageindex; /* page path to struct pageinfo */
+
+/* reused objects, see commitlookup() and treelookup() */
+static git_commit *lastparent;
+static git_tree *lastparenttree;
+
+/* file history index (-H) */
+static int filehistory;
+static git_oid *histcommits;
+static size_t nhistcommits, histcommitscap;
+static struct strtab histpaths; /* path -> struct pathhist */
+static FILE *rhistfp, *whistfp;
+static char histfile[PATH_MAX];
+
+/* archives of the tags (-z) */
+static int tarballs;
+
+/* blame pages (-B) */
+#define BLAMEVERSION 2 /* changes when the rendering of the pages changes */
+static int blamepages;
+
+/* statistics per author and month (-A) */
+struct statcount {
+	size_t commits;
+	size_t add;
+	size_t del;
+};
+static int statspage;
+static struct strtab statauthors; /* author name -> struct statcount */
+static struct strtab statmonths;  /* "YYYY-MM" -> struct statcount */
+static char statsfile[PATH_MAX];
+
+/* search index (-S) */
+#define SEARCHDOCSPERSHARD 1024
+static int searchindex;
+static struct searchdoc *searchdocs; /* documents of this run, newest first */
+static size_t nsearchdocs, searchdocscap;
+static struct strtab searchterms; /* term -> struct postings */
+static size_t searchbase; /* number of documents of previous runs */
+static struct strtab searchstale; /* shards of previous runs, see search_write() */
+
+/* existing commit pages, "commit/index.txt" has the key of the inputs
+   each page was written with: pages with another key are written again */
+#define COMMITVERSION 2 /* changes when the rendering of the pages changes */
+static struct oidset commitpages;
+static size_t commitkey;
+static int outpipe = -1; /* pages of a child process to the parent */
+
+/* first-parent chain of HEAD (-c): "<cachefile>.chain" has the raw object
+   ids of the commits, oldest first: position i is at i * GIT_OID_RAWSZ. it
+   is only appended to, and truncated when the history was rewritten. */
+static char chainfile[PATH_MAX];
+static int chainfd = -1;
+static size_t nchain;          /* commits in the file */
+static struct oidset chainpos; /* id -> position (key), read when needed */
+static git_oid *chainnew;      /* commits of HEAD after chainbase, newest first */
+static size_t nchainnew, chainnewcap;
+static size_t chainbase;       /* commits of the file that are kept */
+static git_oid *chainlog;      /* commits of the log of HEAD, newest first */
+static size_t nchainlog;
+
+/* logs of the branches matching a pattern (-b) */
+static char **branchglobs;
+static size_t nbranchglobs;
+static int walkedall = 1; /* all commits of the logs were walked */
+
+/* archive of all pages (-a): "<archive>.<n>.pack" has the data of the
+   pages appended, "<archive>.idx" the sorted "offset length path" lines
+   of the current data of each page. */
+struct packentry {
+	off_t off;
+	size_t len;
+};
+static const char *archive;
+static struct strtab packindex; /* path -> struct packentry */
+static int packfd = -1;
+static unsigned packgen;    /* n of the data file */
+static off_t packsize;      /* size of the data file */
+static off_t packlive;      /* bytes of the data file that are used */
+
+/* cost report (-r): the most expensive commits and blobs */
+struct cost {
+	char *name; /* commit id or path */
+	double start, total, diff, similar, patch, write; /* seconds */
+	size_t deltas, hunks, lines, bytes;
+	size_t allocs, heap; /* of the arena of the commit */
+};
+static const char *reportfile;
+static struct cost cost; /* of the current commit */
+static struct cost *topcommits, *topblobs; /* most expensive first */
+static size_t ntopcommits, ntopblobs;
+
+/* outputs to update, only the ones of the updated refs with -u */
+static int refupdates;
+static int updatehead = 1, updaterefs = 1, updatetags = 1;
+
+/* verification (-V): the pages of a full run in a scratch directory are
+   compared with the existing pages */
+static char verifydir[PATH_MAX];  /* the scratch directory */
+static char verifyroot[PATH_MAX]; /* directory of the existing pages */
+static const char *verifyarchive; /* archive of the existing pages */
+static const char *verifycache;   /* cache file, not a page */
+static const char *verifyreport;  /* report file (-r), not a page */
+static int deferpages; /* write new commit pages in writestalecommits() */
+
+/* output files */
+static mode_t outmode; /* permissions of new files, umask applied */
+static size_t noutfiles, noutchanged;
 
 /* cache */
 static git_oid lastoid;
@@ -88,16 +350,501 @@ joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
 			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
 }
 
+/* The parent of a commit on the first-parent walk is the next commit that
+   is processed: keep the last freed parent commit and tree for reuse. */
+git_commit *
+commitlookup(const git_oid *id)
+{
+	git_commit *commit;
+
+	if (lastparent && git_oid_equal(git_commit_id(lastparent), id)) {
+		commit = lastparent;
+		lastparent = NULL;
+		return commit;
+	}
+	if (git_commit_lookup(&commit, repo, id))
+		return NULL;
+
+	return commit;
+}
+
+git_tree *
+treelookup(const git_oid *id)
+{
+	git_tree *tree;
+
+	if (lastparenttree && git_oid_equal(git_tree_id(lastparenttree), id)) {
+		tree = lastparenttree;
+		lastparenttree = NULL;
+		return tree;
+	}
+	if (git_tree_lookup(&tree, repo, id))
+		return NULL;
+
+	return tree;
+}
+
+void
+objcache_free(void)
+{
+	git_commit_free(lastparent);
+	lastparent = NULL;
+	git_tree_free(lastparenttree);
+	lastparenttree = NULL;
+}
+
+struct oidsetentry *
+oidset_find(struct oidset *set, const git_oid *id)
+{
+	size_t h;
+
+	if (!set->cap)
+		return NULL;
+	/* object ids are uniformly distributed: use the first bytes as hash */
+	memcpy(&h, id->id, sizeof(h));
+	for (h &= set->cap - 1; set->entries[h].used; h = (h + 1) & (set->cap - 1))
+		if (git_oid_equal(&(set->entries[h].id), id))
+			break;
+
+	return &(set->entries[h]);
+}
+
+struct oidsetentry *
+oidset_get(struct oidset *set, const git_oid *id)
+{
+	struct oidsetentry *e;
+
+	if (!(e = oidset_find(set, id)) || !e->used)
+		return NULL;
+
+	return e;
+}
+
+struct oidsetentry *
+oidset_add(struct oidset *set, const git_oid *id)
+{
+	struct oidsetentry *e, *old;
+	size_t i, oldcap;
+
+	/* grow when more than half full */
+	if ((set->n + 1) * 2 > set->cap) {
+		old = set->entries;
+		oldcap = set->cap;
+		set->cap = oldcap ? oldcap * 2 : 1024;
+		if (!(set->entries = calloc(set->cap, sizeof(*(set->entries)))))
+			err(1, "calloc");
+		for (i = 0; i < oldcap; i++)
+			if (old[i].used)
+				*oidset_find(set, &(old[i].id)) = old[i];
+		free(old);
+	}
+	e = oidset_find(set, id);
+	if (!e->used) {
+		e->id = *id;
+		e->used = 1;
+		set->n++;
+	}
+
+	return e;
+}
+
+void
+oidset_free(struct oidset *set)
+{
+	free(set->entries);
+	memset(set, 0, sizeof(*set));
+}
+
+/* read the object ids of existing commit pages "commit/<oid>.html" */
+void
+readcommitpages(struct oidset *set, const char *dir)
+{
+	struct dirent *d;
+	DIR *dp;
+	git_oid id;
+	const char *name;
+	size_t i, len = strlen(dir);
+
+	/* the pages of the archive: "<dir>/<name>" */
+	if (archive) {
+		for (i = 0; i < packindex.cap; i++) {
+			if (!(name = packindex.entries[i].key) ||
+			    strncmp(name, dir, len) || name[len] != '/')
+				continue;
+			name += len + 1;
+			if (strlen(name) != GIT_OID_HEXSZ + strlen(".html") ||
+			    strcmp(name + GIT_OID_HEXSZ, ".html") ||
+			    git_oid_fromstrn(&id, name, GIT_OID_HEXSZ))
+				continue;
+			oidset_add(set, &id);
+		}
+		return;
+	}
+
+	if (!(dp = opendir(dir)))
+		return;
+	while ((d = readdir(dp))) {
+		if (strlen(d->d_name) != GIT_OID_HEXSZ + strlen(".html") ||
+		    strcmp(d->d_name + GIT_OID_HEXSZ, ".html") ||
+		    git_oid_fromstrn(&id, d->d_name, GIT_OID_HEXSZ))
+			continue;
+		oidset_add(set, &id);
+	}
+	closedir(dp);
+}
+
+/* FNV-1a */
+size_t
+strhash(const char *s)
+{
+	size_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+
+	return h;
+}
+
+struct strtabentry *
+strtab_find(struct strtab *t, const char *key)
+{
+	size_t h;
+
+	if (!t->cap)
+		return NULL;
+	for (h = strhash(key) & (t->cap - 1); t->entries[h].key;
+	     h = (h + 1) & (t->cap - 1))
+		if (!strcmp(t->entries[h].key, key))
+			break;
+
+	return &(t->entries[h]);
+}
+
+/* get the entry of key, a new entry has no data */
+struct strtabentry *
+strtab_get(struct strtab *t, const char *key)
+{
+	struct strtabentry *e, *old;
+	size_t i, oldcap;
+
+	/* grow when more than half full */
+	if ((t->n + 1) * 2 > t->cap) {
+		old = t->entries;
+		oldcap = t->cap;
+		t->cap = oldcap ? oldcap * 2 : 1024;
+		if (!(t->entries = calloc(t->cap, sizeof(*(t->entries)))))
+			err(1, "calloc");
+		for (i = 0; i < oldcap; i++)
+			if (old[i].key)
+				*strtab_find(t, old[i].key) = old[i];
+		free(old);
+	}
+	e = strtab_find(t, key);
+	if (!e->key) {
+		if (!(e->key = strdup(key)))
+			err(1, "strdup");
+		t->n++;
+	}
+
+	return e;
+}
+
+/* remove the entry of key, returns its data that is freed by the caller */
+void *
+strtab_del(struct strtab *t, const char *key)
+{
+	struct strtabentry *e;
+	void *data;
+	size_t i, j, h;
+
+	if (!(e = strtab_find(t, key)) || !e->key)
+		return NULL;
+	data = e->data;
+	free(e->key);
+	/* move the next entries of the run that hash before the free slot */
+	i = e - t->entries;
+	for (j = (i + 1) & (t->cap - 1); t->entries[j].key;
+	     j = (j + 1) & (t->cap - 1)) {
+		h = strhash(t->entries[j].key) & (t->cap - 1);
+		if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+			continue;
+		t->entries[i] = t->entries[j];
+		i = j;
+	}
+	t->entries[i].key = NULL;
+	t->entries[i].data = NULL;
+	t->n--;
+
+	return data;
+}
+
+/* free the table and its keys, the data is freed by the caller */
+void
+strtab_free(struct strtab *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->cap; i++)
+		free(t->entries[i].key);
+	free(t->entries);
+	memset(t, 0, sizeof(*t));
+}
+
+/* allocate zeroed memory from the arena */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arenachunk *c;
+	void *p;
+
+	/* keep the alignment of malloc() for any type */
+	size = (size + 15) & ~(size_t)15;
+	a->nallocs++;
+
+	if (!(c = a->chunks) || c->cap - c->len < size) {
+		if (size <= ARENACHUNKSIZ && (c = a->free)) {
+			a->free = c->next;
+		} else {
+			/* large allocations get a chunk of their own */
+			if (!(c = calloc(1, sizeof(*c))) ||
+			    !(c->data = malloc(size > ARENACHUNKSIZ ? size : ARENACHUNKSIZ)))
+				err(1, "malloc");
+			c->cap = size > ARENACHUNKSIZ ? size : ARENACHUNKSIZ;
+			a->nheap++;
+		}
+		c->len = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+	p = c->data + c->len;
+	c->len += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+/* free all allocations: chunks of the standard size are kept for reuse */
+void
+arena_reset(struct arena *a)
+{
+	struct arenachunk *c, *next;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		if (c->cap == ARENACHUNKSIZ) {
+			c->next = a->free;
+			a->free = c;
+		} else {
+			free(c->data);
+			free(c);
+		}
+	}
+	a->chunks = NULL;
+	a->nallocs = 0;
+	a->nheap = 0;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arenachunk *c, *next;
+
+	arena_reset(a);
+	for (c = a->free; c; c = next) {
+		next = c->next;
+		free(c->data);
+		free(c);
+	}
+	a->free = NULL;
+}
+
 void
 deltainfo_free(struct deltainfo *di)
 {
 	if (!di)
 		return;
 	git_patch_free(di->patch);
-	memset(di, 0, sizeof(*di));
-	free(di);
+	di->patch = NULL;
+}
+
+/* free the deltas of a commit, their memory is reset with its arena */
+void
+commitinfo_freedeltas(struct commitinfo *ci)
+{
+	size_t i;
+
+	if (ci->deltas)
+		for (i = 0; i < ci->ndeltas; i++)
+			deltainfo_free(ci->deltas[i]);
+	ci->deltas = NULL;
+	ci->ndeltas = 0;
+}
+
+/* monotonic time in seconds */
+double
+monotime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* monotonic time in seconds for the cost report, 0 when it is not used */
+double
+costtime(void)
+{
+	if (!reportfile)
+		return 0;
+	return monotime();
+}
+
+/* start the cost of a commit */
+void
+cost_begin(const char *name)
+{
+	memset(&cost, 0, sizeof(cost));
+	cost.name = (char *)name;
+	cost.start = costtime();
+}
+
+/* add a cost to the sorted top costs if it is one of the most expensive */
+void
+cost_add(struct cost **top, size_t *n, const struct cost *c)
+{
+	size_t i;
+
+	if (!reportsize)
+		return;
+	if (!*top && !(*top = calloc(reportsize, sizeof(**top))))
+		err(1, "calloc");
+	if (*n == (size_t)reportsize) {
+		if ((*top)[*n - 1].total >= c->total)
+			return;
+		free((*top)[--(*n)].name);
+	}
+	for (i = *n; i > 0 && (*top)[i - 1].total < c->total; i--)
+		(*top)[i] = (*top)[i - 1];
+	(*top)[i] = *c;
+	if (!((*top)[i].name = strdup(c->name)))
+		err(1, "strdup");
+	(*n)++;
+}
+
+/* finish the cost of the current commit */
+void
+cost_end(void)
+{
+	if (!reportfile)
+		return;
+	cost.total = costtime() - cost.start;
+	cost_add(&topcommits, &ntopcommits, &cost);
+}
+
+void
+writecostcsv(FILE *fp, const char *type, const struct cost *c, size_t n)
+{
+	const char *p;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s,\"", type);
+		for (p = c[i].name; *p; p++) {
+			if (*p == '"')
+				fputc('"', fp);
+			fputc(*p, fp);
+		}
+		fprintf(fp, "\",%.3f,%.3f,%.3f,%.3f,%.3f,%zu,%zu,%zu,%zu,%zu,%zu\n",
+		        c[i].total * 1000, c[i].diff * 1000, c[i].similar * 1000,
+		        c[i].patch * 1000, c[i].write * 1000,
+		        c[i].deltas, c[i].hunks, c[i].lines, c[i].bytes,
+		        c[i].allocs, c[i].heap);
+	}
+}
+
+/* write the most expensive commits and blobs as CSV, times are in
+   milliseconds */
+void
+writereport(void)
+{
+	FILE *fp;
+	size_t i;
+
+	if (!(fp = fopen(reportfile, "w")))
+		err(1, "fopen: '%s'", reportfile);
+	fputs("type,id,total,diff,similar,patch,write,deltas,hunks,lines,bytes,"
+	      "allocs,heap\n", fp);
+	writecostcsv(fp, "commit", topcommits, ntopcommits);
+	writecostcsv(fp, "blob", topblobs, ntopblobs);
+	if (ferror(fp) || fclose(fp))
+		err(1, "fwrite: '%s'", reportfile);
+
+	for (i = 0; i < ntopcommits; i++)
+		free(topcommits[i].name);
+	for (i = 0; i < ntopblobs; i++)
+		free(topblobs[i].name);
+	free(topcommits);
+	free(topblobs);
+}
+
+/* count the added and deleted lines and the bytes of a patch */
+void
+patch_linestats(git_patch *patch, size_t *add, size_t *del, size_t *bytes)
+{
+	const git_diff_hunk *hunk;
+	const git_diff_line *line;
+	size_t nhunks, nhunklines, j, k;
+
+	nhunks = git_patch_num_hunks(patch);
+	cost.hunks += nhunks;
+	for (j = 0; j < nhunks; j++) {
+		if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
+			break;
+		*bytes += hunk->header_len;
+		for (k = 0; ; k++) {
+			if (git_patch_get_line_in_hunk(&line, patch, j, k))
+				break;
+			*bytes += line->content_len;
+			if (line->old_lineno == -1)
+				(*add)++;
+			else if (line->new_lineno == -1)
+				(*del)++;
+		}
+		cost.lines += k;
+	}
+}
+
+/* the least bytes of the patch of a file: the difference of the sizes of
+   its blobs. 0 when they are unknown */
+size_t
+delta_minbytes(git_odb *odb, const git_diff_delta *delta)
+{
+	git_object_t type;
+	size_t oldsize = 0, newsize = 0;
+
+	if ((!git_oid_iszero(&(delta->old_file.id)) &&
+	     git_odb_read_header(&oldsize, &type, odb, &(delta->old_file.id))) ||
+	    (!git_oid_iszero(&(delta->new_file.id)) &&
+	     git_odb_read_header(&newsize, &type, odb, &(delta->new_file.id))))
+		return 0;
+
+	return oldsize > newsize ? oldsize - newsize : newsize - oldsize;
+}
+
+/* options of the diff of a commit, also used for the split file pages */
+void
+commitdiffoptions(git_diff_options *opts)
+{
+	git_diff_init_options(opts, GIT_DIFF_OPTIONS_VERSION);
+	opts->flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH |
+	               GIT_DIFF_IGNORE_SUBMODULES |
+	               GIT_DIFF_INCLUDE_TYPECHANGE;
 }
 
+/* the diffstat of a commit, which is allocated from an arena, see
+   commitinfo_getbyoid() */
 int
 commitinfo_getstats(struct commitinfo *ci)
 {
@@ -105,78 +852,137 @@ commitinfo_getstats(struct commitinfo *ci)
 	git_diff_options opts;
 	git_diff_find_options fopts;
 	const git_diff_delta *delta;
-	const git_diff_hunk *hunk;
-	const git_diff_line *line;
 	git_patch *patch = NULL;
-	size_t ndeltas, nhunks, nhunklines;
-	size_t i, j, k;
+	git_odb *odb = NULL;
+	size_t ndeltas, nadded, nsources, i, changed, min;
+	size_t shownlines = 0, shownbytes = 0;
+	double t;
 
-	if (git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
+	t = costtime();
+	if (!(ci->commit_tree = treelookup(git_commit_tree_id(ci->commit))))
 		goto err;
 	if (!git_commit_parent(&(ci->parent), ci->commit, 0)) {
-		if (git_tree_lookup(&(ci->parent_tree), repo, git_commit_tree_id(ci->parent))) {
+		if (!(ci->parent_tree = treelookup(git_commit_tree_id(ci->parent)))) {
 			ci->parent = NULL;
 			ci->parent_tree = NULL;
 		}
 	}
 
-	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
-	opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH |
-	              GIT_DIFF_IGNORE_SUBMODULES |
-		      GIT_DIFF_INCLUDE_TYPECHANGE;
+	commitdiffoptions(&opts);
 	if (git_diff_tree_to_tree(&(ci->diff), repo, ci->parent_tree, ci->commit_tree, &opts))
 		goto err;
+	cost.diff += costtime() - t;
+
+	if (renames) {
+		/* each added file is compared to each deleted (renames) and
+		   modified (copies) file: skip when there are too many pairs. */
+		nadded = nsources = 0;
+		ndeltas = git_diff_num_deltas(ci->diff);
+		for (i = 0; i < ndeltas; i++) {
+			switch (git_diff_get_delta(ci->diff, i)->status) {
+			case GIT_DELTA_ADDED:
+				nadded++;
+				break;
+			case GIT_DELTA_DELETED:
+			case GIT_DELTA_MODIFIED:
+				nsources++;
+				break;
+			default:
+				break;
+			}
+		}
+		if (!nadded || !nsources) {
+			/* nothing to detect */
+		} else if (!renamelimit || nadded * nsources <= (size_t)renamelimit) {
+			if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
+				goto err;
+			fopts.flags |= GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES;
+			if (renames < 0) {
+				/* exact matches (no heuristic) */
+				fopts.flags |= GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+			} else {
+				fopts.rename_threshold = renames;
+				fopts.copy_threshold = renames;
+			}
+			t = costtime();
+			if (git_diff_find_similar(ci->diff, &fopts))
+				goto err;
+			cost.similar += costtime() - t;
+		} else {
+			ci->renamepairs = nadded * nsources;
+		}
+	}
 
-	if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
-		goto err;
-	/* find renames and copies, exact matches (no heuristic) for renames. */
-	fopts.flags |= GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
-	               GIT_DIFF_FIND_EXACT_MATCH_ONLY;
-	if (git_diff_find_similar(ci->diff, &fopts))
-		goto err;
-
+	t = costtime();
 	ndeltas = git_diff_num_deltas(ci->diff);
-	if (ndeltas && !(ci->deltas = calloc(ndeltas, sizeof(struct deltainfo *))))
-		err(1, "calloc");
+	if (ndeltas)
+		ci->deltas = arena_alloc(ci->arena, ndeltas * sizeof(struct deltainfo *));
 
-	for (i = 0; i < ndeltas; i++) {
-		if (git_patch_from_diff(&patch, ci->diff, i))
-			goto err;
+	if ((diffbytes || commitbytes) && git_repository_odb(&odb, repo))
+		goto err;
 
-		if (!(di = calloc(1, sizeof(struct deltainfo))))
-			err(1, "calloc");
-		di->patch = patch;
+	/* the limits of the diffs are applied in the order of the files, the
+	   patch of a file that is over a limit by the sizes of its blobs is
+	   not generated */
+	for (i = 0; i < ndeltas; i++) {
+		di = arena_alloc(ci->arena, sizeof(struct deltainfo));
 		ci->deltas[i] = di;
+		ci->ndeltas = i + 1;
+
+		min = odb ? delta_minbytes(odb, git_diff_get_delta(ci->diff, i)) : 0;
+		if (diffbytes && min > (size_t)diffbytes)
+			di->over = "file";
+		else if (commitbytes && shownbytes + min > (size_t)commitbytes)
+			di->over = "commit";
+		if (di->over) {
+			di->minbytes = min;
+			continue;
+		}
 
+		if (git_patch_from_diff(&patch, ci->diff, i))
+			goto err;
 		delta = git_patch_get_delta(patch);
 
 		/* skip stats for binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY)
-			continue;
+		if (!(delta->flags & GIT_DIFF_FLAG_BINARY)) {
+			patch_linestats(patch, &(di->addcount), &(di->delcount),
+			                &(di->bytes));
+			ci->addcount += di->addcount;
+			ci->delcount += di->delcount;
+		}
 
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1) {
-					di->addcount++;
-					ci->addcount++;
-				} else if (line->new_lineno == -1) {
-					di->delcount++;
-					ci->delcount++;
-				}
-			}
+		changed = di->addcount + di->delcount;
+		if ((difflines && changed > (size_t)difflines) ||
+		    (diffbytes && di->bytes > (size_t)diffbytes))
+			di->over = "file";
+		else if ((commitlines && shownlines + changed > (size_t)commitlines) ||
+		         (commitbytes && shownbytes + di->bytes > (size_t)commitbytes))
+			di->over = "commit";
+		/* large diffs on their own page, not counted for the commit */
+		else if (splitdiff && di->bytes > (size_t)splitdiff)
+			di->split = 1;
+		else {
+			shownlines += changed;
+			shownbytes += di->bytes;
 		}
+
+		/* streaming: the patch is generated again when it is written.
+		   the patch of a file that is not shown is not kept. */
+		if (streamdiff || di->over || di->split)
+			git_patch_free(patch);
+		else
+			di->patch = patch;
 	}
+	git_odb_free(odb);
 	ci->ndeltas = i;
 	ci->filecount = i;
+	cost.patch += costtime() - t;
+	cost.deltas += ndeltas;
 
 	return 0;
 
 err:
+	git_odb_free(odb);
 	git_diff_free(ci->diff);
 	ci->diff = NULL;
 	git_tree_free(ci->commit_tree);
@@ -186,15 +992,11 @@ err:
 	git_commit_free(ci->parent);
 	ci->parent = NULL;
 
-	if (ci->deltas)
-		for (i = 0; i < ci->ndeltas; i++)
-			deltainfo_free(ci->deltas[i]);
-	free(ci->deltas);
-	ci->deltas = NULL;
-	ci->ndeltas = 0;
+	commitinfo_freedeltas(ci);
 	ci->addcount = 0;
 	ci->delcount = 0;
 	ci->filecount = 0;
+	ci->renamepairs = 0;
 
 	return -1;
 }
@@ -202,33 +1004,56 @@ err:
 void
 commitinfo_free(struct commitinfo *ci)
 {
-	size_t i;
+	struct arena *a;
 
 	if (!ci)
 		return;
-	if (ci->deltas)
-		for (i = 0; i < ci->ndeltas; i++)
-			deltainfo_free(ci->deltas[i]);
-
-	free(ci->deltas);
+	commitinfo_freedeltas(ci);
 	git_diff_free(ci->diff);
 	git_tree_free(ci->commit_tree);
-	git_tree_free(ci->parent_tree);
 	git_commit_free(ci->commit);
-	git_commit_free(ci->parent);
-	memset(ci, 0, sizeof(*ci));
-	free(ci);
+	/* keep the parent for the next commit */
+	if (ci->parent) {
+		git_commit_free(lastparent);
+		lastparent = ci->parent;
+	}
+	if (ci->parent_tree) {
+		git_tree_free(lastparenttree);
+		lastparenttree = ci->parent_tree;
+	}
+	if (!(a = ci->arena)) {
+		memset(ci, 0, sizeof(*ci));
+		free(ci);
+		return;
+	}
+
+	/* instrumentation: the allocations of the commit were one malloc()
+	   each, now they are taken from the chunks of the arena */
+	cost.allocs = a->nallocs;
+	cost.heap = a->nheap;
+	arenacommits++;
+	arenaallocs += a->nallocs;
+	arenaheap += a->nheap;
+	if (a->nallocs > arenamaxallocs)
+		arenamaxallocs = a->nallocs;
+	arena_reset(a);
 }
 
+/* get a commit: with an arena it is allocated from it together with its
+   diffstat and the arena is reset when it is freed, so only one commit of
+   an arena is used at a time. without an arena it has no diffstat. */
 struct commitinfo *
-commitinfo_getbyoid(const git_oid *id)
+commitinfo_getbyoid(const git_oid *id, struct arena *a)
 {
 	struct commitinfo *ci;
 
-	if (!(ci = calloc(1, sizeof(struct commitinfo))))
+	if (a)
+		ci = arena_alloc(a, sizeof(struct commitinfo));
+	else if (!(ci = calloc(1, sizeof(struct commitinfo))))
 		err(1, "calloc");
+	ci->arena = a;
 
-	if (git_commit_lookup(&(ci->commit), repo, id))
+	if (!(ci->commit = commitlookup(id)))
 		goto err;
 	ci->id = id;
 
@@ -309,13 +1134,14 @@ getrefs(struct referenceinfo **pris, size_t *prefcount)
 			goto err;
 		if (!(id = git_object_id(obj)))
 			goto err;
-		if (!(ci = commitinfo_getbyoid(id)))
+		if (!(ci = commitinfo_getbyoid(id, NULL)))
 			break;
 
 		if (!(ris = reallocarray(ris, refcount + 1, sizeof(*ris))))
 			err(1, "realloc");
 		ris[refcount].ci = ci;
 		ris[refcount].ref = r;
+		ris[refcount].archive = 0;
 		refcount++;
 
 		git_object_free(obj);
@@ -346,42 +1172,22 @@ err:
 	return -1;
 }
 
-FILE *
-efopen(const char *name, const char *flags)
-{
-	FILE *fp;
-
-	if (!(fp = fopen(name, flags)))
-		err(1, "fopen: '%s'", name);
-
-	return fp;
-}
-
-/* Escape characters below as HTML 2.0 / XML 1.0. */
-void
-xmlencode(FILE *fp, const char *s, size_t len)
-{
-	size_t i;
-
-	for (i = 0; *s && i < len; s++, i++) {
-		switch(*s) {
-		case '<':  fputs("&lt;",   fp); break;
-		case '>':  fputs("&gt;",   fp); break;
-		case '\'': fputs("&#39;",  fp); break;
-		case '&':  fputs("&amp;",  fp); break;
-		case '"':  fputs("&quot;", fp); break;
-		default:   fputc(*s, fp);
-		}
-	}
-}
-
 int
 mkdirp(const char *path)
 {
+	static char lastdir[PATH_MAX];
 	char tmp[PATH_MAX], *p;
 
+	/* the files of a directory are mostly written after each other */
+	if (!strcmp(path, lastdir))
+		return 0;
 	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
 		errx(1, "path truncated: '%s'", path);
+	/* the parents only have to be created for a new directory */
+	if (!mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) || errno == EEXIST) {
+		strlcpy(lastdir, tmp, sizeof(lastdir));
+		return 0;
+	}
 	for (p = tmp + (tmp[0] == '/'); *p; p++) {
 		if (*p != '/')
 			continue;
@@ -392,555 +1198,3437 @@ mkdirp(const char *path)
 	}
 	if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
 		return -1;
+	strlcpy(lastdir, tmp, sizeof(lastdir));
 	return 0;
 }
 
+/* write data to a temporary file and rename it to path. */
 void
-printtimez(FILE *fp, const git_time *intime)
+writeatomic(const char *path, const char *buf, size_t len)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
-
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%Y-%m-%dT%H:%M:%SZ", intm);
-	fputs(out, fp);
+	char tmppath[PATH_MAX];
+	FILE *fp;
+	int fd, r;
+
+	r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+	if (r < 0 || (size_t)r >= sizeof(tmppath))
+		errx(1, "path truncated: '%s.XXXXXX'", path);
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp: '%s'", tmppath);
+	if (fchmod(fd, outmode) == -1)
+		err(1, "fchmod: '%s'", tmppath);
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	if (fwrite(buf, 1, len, fp) != len || fclose(fp))
+		err(1, "fwrite: '%s'", tmppath);
+	if (rename(tmppath, path))
+		err(1, "rename: '%s' to '%s'", tmppath, path);
 }
 
 void
-printtime(FILE *fp, const git_time *intime)
+packdatapath(char *buf, size_t bufsiz, unsigned gen)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	int r;
 
-	t = (time_t)intime->time + (intime->offset * 60);
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%a, %e %b %Y %H:%M:%S", intm);
-	if (intime->offset < 0)
-		fprintf(fp, "%s -%02d%02d", out,
-		            -(intime->offset) / 60, -(intime->offset) % 60);
-	else
-		fprintf(fp, "%s +%02d%02d", out,
-		            intime->offset / 60, intime->offset % 60);
+	r = snprintf(buf, bufsiz, "%s.%u.pack", archive, gen);
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: '%s.%u.pack'", archive, gen);
 }
 
+/* read len bytes at off of the data file */
 void
-printtimeshort(FILE *fp, const git_time *intime)
+pack_pread(int fd, char *buf, size_t len, off_t off)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	ssize_t n;
 
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%Y-%m-%d %H:%M", intm);
-	fputs(out, fp);
+	for (; len > 0; buf += n, len -= n, off += n) {
+		if ((n = pread(fd, buf, len, off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err(1, "pread: '%s'", archive);
+		}
+		if (n == 0)
+			errx(1, "%s: truncated data file", archive);
+	}
 }
 
 void
-writeheader(FILE *fp, const char *title)
+pack_pwrite(int fd, const char *buf, size_t len, off_t off)
 {
-	fputs("<!DOCTYPE html>\n"
-		"<html>\n<head>\n"
-		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
-		"<title>", fp);
-	xmlencode(fp, title, strlen(title));
-	if (title[0] && strippedname[0])
-		fputs(" - ", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	if (description[0])
-		fputs(" - ", fp);
-	xmlencode(fp, description, strlen(description));
-	fprintf(fp, "</title>\n<link rel=\"icon\" type=\"image/png\" href=\"%sfavicon.png\" />\n", relpath);
-	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed\" href=\"%satom.xml\" />\n",
-		name, relpath);
-	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed (tags)\" href=\"%stags.xml\" />\n",
-		name, relpath);
-	fprintf(fp, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%sstyle.css\" />\n", relpath);
-	fputs("</head>\n<body>\n<table><tr><td>", fp);
-	fprintf(fp, "<a href=\"../%s\"><img src=\"%slogo.png\" alt=\"\" width=\"32\" height=\"32\" /></a>",
-	        relpath, relpath);
-	fputs("</td><td><h1>", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	fputs("</h1><span class=\"desc\">", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</span></td></tr>", fp);
-	if (cloneurl[0]) {
-		fputs("<tr class=\"url\"><td></td><td>git clone <a href=\"", fp);
-		xmlencode(fp, cloneurl, strlen(cloneurl));
-		fputs("\">", fp);
-		xmlencode(fp, cloneurl, strlen(cloneurl));
-		fputs("</a></td></tr>", fp);
+	ssize_t n;
+
+	for (; len > 0; buf += n, len -= n, off += n) {
+		if ((n = pwrite(fd, buf, len, off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err(1, "pwrite: '%s'", archive);
+		}
 	}
-	fputs("<tr><td></td><td>\n", fp);
-	fprintf(fp, "<a href=\"%slog.html\">Log</a> | ", relpath);
-	fprintf(fp, "<a href=\"%sfiles.html\">Files</a> | ", relpath);
-	fprintf(fp, "<a href=\"%srefs.html\">Refs</a>", relpath);
-	if (submodules)
-		fprintf(fp, " | <a href=\"%sfile/%s.html\">Submodules</a>",
-		        relpath, submodules);
-	if (readme)
-		fprintf(fp, " | <a href=\"%sfile/%s.html\">README</a>",
-		        relpath, readme);
-	if (license)
-		fprintf(fp, " | <a href=\"%sfile/%s.html\">LICENSE</a>",
-		        relpath, license);
-	fputs("</td></tr></table>\n<hr/>\n<div id=\"content\">\n", fp);
 }
 
-void
-writefooter(FILE *fp)
+struct packentry *
+pack_find(const char *path)
 {
-	fputs("</div>\n</body>\n</html>\n", fp);
+	struct strtabentry *e;
+
+	if (!(e = strtab_find(&packindex, path)) || !e->key)
+		return NULL;
+	return e->data;
 }
 
-int
-writeblobhtml(FILE *fp, const git_blob *blob)
+/* open the archive: read the index of the last run (does not need to
+   exist) and open its data file for appending pages */
+void
+pack_open(void)
 {
-	size_t n = 0, i, prev;
-	const char *nfmt = "<a href=\"#l%d\" class=\"line\" id=\"l%d\">%7d</a> ";
-	const char *s = git_blob_rawcontent(blob);
-	git_off_t len = git_blob_rawsize(blob);
-
-	fputs("<pre id=\"blob\">\n", fp);
+	struct strtabentry *e;
+	struct packentry *pe;
+	struct stat st;
+	FILE *fp;
+	char path[PATH_MAX], *line = NULL, *p;
+	size_t linesiz = 0;
+	ssize_t linelen;
+	long long off, len;
+	int r;
 
-	if (len > 0) {
-		for (i = 0, prev = 0; i < (size_t)len; i++) {
-			if (s[i] != '\n')
+	r = snprintf(path, sizeof(path), "%s.idx", archive);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: '%s.idx'", archive);
+	if ((fp = fopen(path, "r"))) {
+		if (fscanf(fp, "%u\n", &packgen) != 1)
+			errx(1, "%s: invalid index", path);
+		while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+			if (line[linelen - 1] == '\n')
+				line[--linelen] = '\0';
+			off = strtoll(line, &p, 10);
+			if (*p != ' ')
 				continue;
-			n++;
-			fprintf(fp, nfmt, n, n, n);
-			xmlencode(fp, &s[prev], i - prev + 1);
-			prev = i + 1;
+			len = strtoll(p + 1, &p, 10);
+			if (*p != ' ' || off < 0 || len < 0)
+				continue;
+			e = strtab_get(&packindex, p + 1);
+			if (!(pe = e->data) && !(pe = e->data = calloc(1, sizeof(*pe))))
+				err(1, "calloc");
+			pe->off = off;
+			pe->len = len;
+			packlive += len;
 		}
-		/* trailing data */
-		if ((len - prev) > 0) {
-			n++;
-			fprintf(fp, nfmt, n, n, n);
-			xmlencode(fp, &s[prev], len - prev);
+		if (ferror(fp))
+			err(1, "getline: '%s'", path);
+		free(line);
+		fclose(fp);
+	}
+
+	packdatapath(path, sizeof(path), packgen);
+	if (verifyarchive) {
+		/* only read by verify(), a missing archive has no pages */
+		if ((packfd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+			if (errno != ENOENT || packindex.n)
+				err(1, "open: '%s'", path);
+			packsize = 0;
+			return;
 		}
+	} else if ((packfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+	                   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) == -1) {
+		err(1, "open: '%s'", path);
 	}
+	if (fstat(packfd, &st) == -1)
+		err(1, "fstat: '%s'", path);
+	/* data after the pages of the index is of an interrupted run */
+	packsize = st.st_size;
+}
 
-	fputs("</pre>\n", fp);
+/* read a page of the archive, returns NULL when it does not exist */
+char *
+pack_read(const char *path, size_t *len)
+{
+	struct packentry *pe;
+	char *buf;
+
+	if (!(pe = pack_find(path)))
+		return NULL;
+	/* one more byte, so an empty page is not NULL */
+	if (!(buf = malloc(pe->len + 1)))
+		err(1, "malloc");
+	pack_pread(packfd, buf, pe->len, pe->off);
+	*len = pe->len;
+
+	return buf;
+}
 
-	return n;
+int
+pack_samecontent(const char *path, const char *buf, size_t len)
+{
+	struct packentry *pe;
+	char rbuf[BUFSIZ];
+	size_t n, off;
+
+	if (!(pe = pack_find(path)) || pe->len != len)
+		return 0;
+	for (off = 0; off < len; off += n) {
+		n = len - off < sizeof(rbuf) ? len - off : sizeof(rbuf);
+		pack_pread(packfd, rbuf, n, pe->off + off);
+		if (memcmp(rbuf, buf + off, n))
+			return 0;
+	}
+
+	return 1;
 }
 
+/* append a page to the data file, it replaces the previous data */
 void
-printcommit(FILE *fp, struct commitinfo *ci)
+pack_write(const char *path, const char *buf, size_t len)
 {
-	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n",
-		relpath, ci->oid, ci->oid);
+	struct strtabentry *e;
+	struct packentry *pe;
 
-	if (ci->parentoid[0])
-		fprintf(fp, "<b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n",
-			relpath, ci->parentoid, ci->parentoid);
+	pack_pwrite(packfd, buf, len, packsize);
+	e = strtab_get(&packindex, path);
+	if (!(pe = e->data) && !(pe = e->data = calloc(1, sizeof(*pe))))
+		err(1, "calloc");
+	else
+		packlive -= pe->len;
+	pe->off = packsize;
+	pe->len = len;
+	packsize += len;
+	packlive += len;
+}
 
-	if (ci->author) {
-		fputs("<b>Author:</b> ", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs(" &lt;<a href=\"mailto:", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("\">", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("</a>&gt;\n<b>Date:</b>   ", fp);
-		printtime(fp, &(ci->author->when));
-		fputc('\n', fp);
+int
+pack_entrycmp(const void *v1, const void *v2)
+{
+	return strcmp((*(struct strtabentry **)v1)->key,
+	              (*(struct strtabentry **)v2)->key);
+}
+
+/* write the index of the archive. When more than packcompact percent of
+   the data file is unused the pages are first copied to a new data file. */
+void
+pack_close(void)
+{
+	struct strtabentry **entries;
+	struct packentry *pe;
+	FILE *fp;
+	char path[PATH_MAX], oldpath[PATH_MAX], buf[BUFSIZ], *ibuf = NULL;
+	size_t i, n = 0, off, len, ilen = 0;
+	off_t newsize = 0;
+	int fd, r, compact;
+
+	if (!(entries = reallocarray(NULL, packindex.n + 1, sizeof(*entries))))
+		err(1, "reallocarray");
+	for (i = 0; i < packindex.cap; i++)
+		if (packindex.entries[i].key)
+			entries[n++] = &(packindex.entries[i]);
+	qsort(entries, n, sizeof(*entries), pack_entrycmp);
+
+	compact = packcompact && packsize &&
+	          (packsize - packlive) * 100 > packcompact * packsize;
+	if (compact) {
+		/* the pages in the order of the index */
+		packdatapath(path, sizeof(path), packgen + 1);
+		if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		               S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) == -1)
+			err(1, "open: '%s'", path);
+		for (i = 0; i < n; i++) {
+			pe = entries[i]->data;
+			for (off = 0; off < pe->len; off += len) {
+				len = pe->len - off < sizeof(buf) ? pe->len - off : sizeof(buf);
+				pack_pread(packfd, buf, len, pe->off + off);
+				pack_pwrite(fd, buf, len, newsize + off);
+			}
+			pe->off = newsize;
+			newsize += pe->len;
+		}
+		close(packfd);
+		packfd = fd;
+		packdatapath(oldpath, sizeof(oldpath), packgen++);
+		packsize = newsize;
 	}
-	if (ci->msg) {
-		fputc('\n', fp);
-		xmlencode(fp, ci->msg, strlen(ci->msg));
-		fputc('\n', fp);
+
+	if (!(fp = open_memstream(&ibuf, &ilen)))
+		err(1, "open_memstream");
+	fprintf(fp, "%u\n", packgen);
+	for (i = 0; i < n; i++) {
+		pe = entries[i]->data;
+		fprintf(fp, "%jd %zu %s\n", (intmax_t)pe->off, pe->len,
+		        entries[i]->key);
 	}
+	if (ferror(fp) || fclose(fp))
+		err(1, "fwrite");
+	r = snprintf(path, sizeof(path), "%s.idx", archive);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: '%s.idx'", archive);
+	writeatomic(path, ibuf, ilen);
+	free(ibuf);
+
+	/* the old data file is not used by the new index anymore */
+	if (compact && unlink(oldpath) == -1)
+		err(1, "unlink: '%s'", oldpath);
+
+	close(packfd);
+	packfd = -1;
+	for (i = 0; i < n; i++)
+		free(entries[i]->data);
+	free(entries);
+	strtab_free(&packindex);
 }
 
-void
-printshowfile(FILE *fp, struct commitinfo *ci)
+/* open an existing output file for reading, buf is set to the data that
+   must be freed with outfclose() */
+FILE *
+outfopen(const char *path, char **buf)
 {
-	const git_diff_delta *delta;
-	const git_diff_hunk *hunk;
-	const git_diff_line *line;
-	git_patch *patch;
-	size_t nhunks, nhunklines, changed, add, del, total, i, j, k;
-	char linestr[80];
-	int c;
+	FILE *fp;
+	size_t len;
 
-	printcommit(fp, ci);
+	*buf = NULL;
+	if (!archive)
+		return fopen(path, "r");
+	if (!(*buf = pack_read(path, &len)))
+		return NULL;
+	if (!(fp = fmemopen(*buf, len, "r")))
+		err(1, "fmemopen: '%s'", path);
 
-	if (!ci->deltas)
-		return;
+	return fp;
+}
 
-	if (ci->filecount > 1000   ||
-	    ci->ndeltas   > 1000   ||
-	    ci->addcount  > 100000 ||
-	    ci->delcount  > 100000) {
-		fputs("Diff is too large, output suppressed.\n", fp);
-		return;
-	}
+void
+outfclose(FILE *fp, char *buf)
+{
+	fclose(fp);
+	free(buf);
+}
 
-	/* diff stat */
-	fputs("<b>Diffstat:</b>\n<table>", fp);
-	for (i = 0; i < ci->ndeltas; i++) {
-		delta = git_patch_get_delta(ci->deltas[i]->patch);
+/* does the output file exist */
+int
+outexists(const char *path)
+{
+	if (archive)
+		return pack_find(path) != NULL;
+	return access(path, F_OK) == 0;
+}
 
-		switch (delta->status) {
-		case GIT_DELTA_ADDED:      c = 'A'; break;
-		case GIT_DELTA_COPIED:     c = 'C'; break;
-		case GIT_DELTA_DELETED:    c = 'D'; break;
-		case GIT_DELTA_MODIFIED:   c = 'M'; break;
-		case GIT_DELTA_RENAMED:    c = 'R'; break;
-		case GIT_DELTA_TYPECHANGE: c = 'T'; break;
-		default:                   c = ' '; break;
-		}
-		if (c == ' ')
-			fprintf(fp, "<tr><td>%c", c);
-		else
-			fprintf(fp, "<tr><td class=\"%c\">%c", c, c);
+/* remove an output file, it does not need to exist */
+void
+outremove(const char *path)
+{
+	struct packentry *pe;
 
-		fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		if (strcmp(delta->old_file.path, delta->new_file.path)) {
-			fputs(" -&gt; ", fp);
-			xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	if (archive) {
+		if ((pe = strtab_del(&packindex, path))) {
+			packlive -= pe->len;
+			free(pe);
 		}
+		return;
+	}
+	if (unlink(path) == -1 && errno != ENOENT)
+		err(1, "unlink: '%s'", path);
+}
 
-		add = ci->deltas[i]->addcount;
-		del = ci->deltas[i]->delcount;
-		changed = add + del;
-		total = sizeof(linestr) - 2;
-		if (changed > total) {
-			if (add)
-				add = ((float)total / changed * add) + 1;
-			if (del)
-				del = ((float)total / changed * del) + 1;
-		}
-		memset(&linestr, '+', add);
-		memset(&linestr[add], '-', del);
+/* create the directory of output files, not needed for the archive */
+int
+outmkdir(const char *path)
+{
+	if (archive)
+		return 0;
+	return mkdirp(path);
+}
 
-		fprintf(fp, "</a></td><td> | </td><td class=\"num\">%zu</td><td><span class=\"i\">",
-		        ci->deltas[i]->addcount + ci->deltas[i]->delcount);
-		fwrite(&linestr, 1, add, fp);
-		fputs("</span><span class=\"d\">", fp);
-		fwrite(&linestr[add], 1, del, fp);
-		fputs("</span></td></tr>\n", fp);
+/* compare data with the contents of the file at path, returns 1 if equal. */
+int
+filesamecontent(const char *path, const char *buf, size_t len)
+{
+	struct stat st;
+	FILE *fp;
+	char rbuf[BUFSIZ];
+	size_t n, off = 0;
+	int same = 0;
+
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (uintmax_t)st.st_size != (uintmax_t)len)
+		goto end;
+	while ((n = fread(rbuf, 1, sizeof(rbuf), fp)) > 0) {
+		if (n > len - off || memcmp(rbuf, buf + off, n))
+			goto end;
+		off += n;
 	}
-	fprintf(fp, "</table></pre><pre>%zu file%s changed, %zu insertion%s(+), %zu deletion%s(-)\n",
-		ci->filecount, ci->filecount == 1 ? "" : "s",
-	        ci->addcount,  ci->addcount  == 1 ? "" : "s",
-	        ci->delcount,  ci->delcount  == 1 ? "" : "s");
+	same = !ferror(fp) && off == len;
+end:
+	fclose(fp);
 
-	fputs("<hr/>", fp);
+	return same;
+}
 
-	for (i = 0; i < ci->ndeltas; i++) {
-		patch = ci->deltas[i]->patch;
-		delta = git_patch_get_delta(patch);
-		fprintf(fp, "<b>diff --git a/<a id=\"h%zu\" href=\"%sfile/", i, relpath);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fputs(".html\">", fp);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, ".html\">");
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, "</a></b>\n");
+/* compare data with the contents of the page at path, returns 1 if equal. */
+int
+samecontent(const char *path, const char *buf, size_t len)
+{
+	if (archive)
+		return pack_samecontent(path, buf, len);
+	return filesamecontent(path, buf, len);
+}
 
-		/* check binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
-			fputs("Binary files differ.\n", fp);
-			continue;
-		}
+#ifdef USE_IO_URING
+/* io_uring output backend: the files are written as a chain of requests
+   openat, write, close and renameat and up to uringdepth files at once. */
+enum { UringOpen, UringWrite, UringClose, UringRename };
+
+struct uringjob {
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX];
+	char *buf;
+	size_t len, off;
+	int fd;
+	int state;
+	int used;
+};
 
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
+struct uring {
+	int fd;
+	void *sqring, *cqring;
+	size_t sqringsiz, cqringsiz, sqessiz;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tosubmit;
+
+	struct uringjob *jobs;
+	size_t njobs, inflight, seq;
+};
 
-			fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
-			xmlencode(fp, hunk->header, hunk->header_len);
-			fputs("</a>", fp);
+static struct uring uring = { .fd = -1 };
+static int uringfailed; /* io_uring is not available, use POSIX I/O */
 
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
-						i, j, k, i, j, k);
-				else if (line->new_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
-						i, j, k, i, j, k);
-				else
-					fputc(' ', fp);
-				xmlencode(fp, line->content, line->content_len);
-				if (line->old_lineno == -1 || line->new_lineno == -1)
-					fputs("</a>", fp);
-			}
-		}
+/* set up the ring, returns -1 when io_uring or one of the operations is
+   not supported by the kernel */
+int
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	unsigned ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE,
+	                   IORING_OP_RENAMEAT };
+	size_t i, probesiz;
+	int fd, r = 0;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, (unsigned)uringdepth, &p)) == -1)
+		return -1;
+
+	probesiz = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	if (!(probe = calloc(1, probesiz)))
+		err(1, "calloc");
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+		r = -1;
+	for (i = 0; !r && i < sizeof(ops) / sizeof(*ops); i++)
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			r = -1;
+	free(probe);
+	if (r || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		return -1;
 	}
+
+	uring.fd = fd;
+	uring.sqringsiz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cqringsiz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (uring.cqringsiz > uring.sqringsiz)
+		uring.sqringsiz = uring.cqringsiz;
+	uring.sqessiz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((uring.sqring = mmap(NULL, uring.sqringsiz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		err(1, "mmap");
+	uring.cqring = uring.sqring;
+	if ((uring.sqes = mmap(NULL, uring.sqessiz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED)
+		err(1, "mmap");
+
+	uring.sqhead = (unsigned *)((char *)uring.sqring + p.sq_off.head);
+	uring.sqtail = (unsigned *)((char *)uring.sqring + p.sq_off.tail);
+	uring.sqmask = (unsigned *)((char *)uring.sqring + p.sq_off.ring_mask);
+	uring.sqarray = (unsigned *)((char *)uring.sqring + p.sq_off.array);
+	uring.cqhead = (unsigned *)((char *)uring.cqring + p.cq_off.head);
+	uring.cqtail = (unsigned *)((char *)uring.cqring + p.cq_off.tail);
+	uring.cqmask = (unsigned *)((char *)uring.cqring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((char *)uring.cqring + p.cq_off.cqes);
+
+	/* each file has at most one request in flight */
+	uring.njobs = uringdepth < p.sq_entries ? uringdepth : p.sq_entries;
+	if (!(uring.jobs = calloc(uring.njobs, sizeof(*uring.jobs))))
+		err(1, "calloc");
+
+	return 0;
 }
 
+/* queue the next request of a file */
 void
-writelogline(FILE *fp, struct commitinfo *ci)
+uring_queue(struct uringjob *job)
 {
-	fputs("<tr><td>", fp);
-	if (ci->author)
-		printtimeshort(fp, &(ci->author->when));
-	fputs("</td><td>", fp);
-	if (ci->summary) {
-		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</a>", fp);
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	tail = *uring.sqtail;
+	sqe = &uring.sqes[tail & *uring.sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = job - uring.jobs;
+
+	switch (job->state) {
+	case UringOpen:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)job->tmppath;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+		/* the umask is applied, as for outmode */
+		sqe->len = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+		break;
+	case UringWrite:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = job->fd;
+		sqe->addr = (uintptr_t)(job->buf + job->off);
+		sqe->len = job->len - job->off > 1 << 30 ? 1 << 30 : job->len - job->off;
+		sqe->off = job->off;
+		break;
+	case UringClose:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = job->fd;
+		break;
+	case UringRename:
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)job->tmppath;
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (uintptr_t)job->path;
+		break;
 	}
-	fputs("</td><td>", fp);
-	if (ci->author)
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "%zu", ci->filecount);
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "+%zu", ci->addcount);
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "-%zu", ci->delcount);
-	fputs("</td></tr>\n", fp);
+	uring.sqarray[tail & *uring.sqmask] = tail & *uring.sqmask;
+	__atomic_store_n(uring.sqtail, tail + 1, __ATOMIC_RELEASE);
+	uring.tosubmit++;
 }
 
-int
-writelog(FILE *fp, const git_oid *oid)
+/* handle the completion of a request, queues the next one of the file */
+void
+uring_complete(struct uringjob *job, int res)
 {
-	struct commitinfo *ci;
-	git_revwalk *w = NULL;
-	git_oid id;
-	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
-	FILE *fpfile;
-	int r;
-
-	git_revwalk_new(&w, repo);
-	git_revwalk_push(w, oid);
-	git_revwalk_simplify_first_parent(w);
-
-	while (!git_revwalk_next(&id, w)) {
-		relpath = "";
-
-		if (cachefile && !memcmp(&id, &lastoid, sizeof(id)))
-			break;
-
-		git_oid_tostr(oidstr, sizeof(oidstr), &id);
-		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
-		if (r < 0 || (size_t)r >= sizeof(path))
-			errx(1, "path truncated: 'commit/%s.html'", oidstr);
-		r = access(path, F_OK);
-
-		/* optimization: if there are no log lines to write and
-		   the commit file already exists: skip the diffstat */
-		if (!nlogcommits && !r)
-			continue;
-
-		if (!(ci = commitinfo_getbyoid(&id)))
-			break;
-		/* diffstat: for stagit HTML required for the log.html line */
-		if (commitinfo_getstats(ci) == -1)
-			goto err;
-
-		if (nlogcommits < 0) {
-			writelogline(fp, ci);
-		} else if (nlogcommits > 0) {
-			writelogline(fp, ci);
-			nlogcommits--;
-			if (!nlogcommits && ci->parentoid[0])
-				fputs("<tr><td></td><td colspan=\"5\">"
-				      "More commits remaining [...]</td>"
-				      "</tr>\n", fp);
+	if (res < 0) {
+		errno = -res;
+		switch (job->state) {
+		case UringOpen:   err(1, "open: '%s'", job->tmppath);
+		case UringWrite:  err(1, "write: '%s'", job->tmppath);
+		case UringClose:  err(1, "close: '%s'", job->tmppath);
+		case UringRename: err(1, "rename: '%s' to '%s'", job->tmppath, job->path);
 		}
+	}
 
-		if (cachefile)
-			writelogline(wcachefp, ci);
+	switch (job->state) {
+	case UringOpen:
+		job->fd = res;
+		job->state = job->len ? UringWrite : UringClose;
+		break;
+	case UringWrite:
+		job->off += res;
+		if (job->off == job->len)
+			job->state = UringClose;
+		break;
+	case UringClose:
+		job->state = UringRename;
+		break;
+	case UringRename:
+		free(job->buf);
+		job->buf = NULL;
+		job->used = 0;
+		uring.inflight--;
+		return;
+	}
+	uring_queue(job);
+}
 
-		/* check if file exists if so skip it */
-		if (r) {
-			relpath = "../";
-			fpfile = efopen(path, "w");
-			writeheader(fpfile, ci->summary);
-			fputs("<pre>", fpfile);
-			printshowfile(fpfile, ci);
-			fputs("</pre>\n", fpfile);
-			writefooter(fpfile);
-			fclose(fpfile);
-		}
-err:
-		commitinfo_free(ci);
+/* submit the queued requests and handle at least one completion */
+void
+uring_wait(void)
+{
+	struct io_uring_cqe *cqe;
+	struct uringjob *job;
+	unsigned head;
+	int r, res;
+
+	r = syscall(__NR_io_uring_enter, uring.fd, uring.tosubmit, 1,
+	            IORING_ENTER_GETEVENTS, NULL, 0);
+	if (r == -1 && errno != EINTR)
+		err(1, "io_uring_enter");
+	if (r > 0)
+		uring.tosubmit -= r;
+
+	for (head = *uring.cqhead;
+	     head != __atomic_load_n(uring.cqtail, __ATOMIC_ACQUIRE); head++) {
+		cqe = &uring.cqes[head & *uring.cqmask];
+		job = &uring.jobs[cqe->user_data];
+		res = cqe->res;
+		__atomic_store_n(uring.cqhead, head + 1, __ATOMIC_RELEASE);
+		uring_complete(job, res);
 	}
-	git_revwalk_free(w);
+}
 
-	relpath = "";
+/* queue a file to be written, the buffer is freed when it is written */
+void
+uring_write(const char *path, char *buf, size_t len)
+{
+	struct uringjob *job;
+	size_t i;
+	int r;
 
-	return 0;
+	while (uring.inflight == uring.njobs)
+		uring_wait();
+	for (i = 0; uring.jobs[i].used; i++)
+		;
+	job = &uring.jobs[i];
+	if (strlcpy(job->path, path, sizeof(job->path)) >= sizeof(job->path))
+		errx(1, "path truncated: '%s'", path);
+	r = snprintf(job->tmppath, sizeof(job->tmppath), "%s.%ld.%zu",
+	             path, (long)getpid(), uring.seq++);
+	if (r < 0 || (size_t)r >= sizeof(job->tmppath))
+		errx(1, "path truncated: '%s.%ld.%zu'", path, (long)getpid(), uring.seq);
+	job->buf = buf;
+	job->len = len;
+	job->off = 0;
+	job->fd = -1;
+	job->state = UringOpen;
+	job->used = 1;
+	uring.inflight++;
+	uring_queue(job);
 }
 
 void
-printcommitatom(FILE *fp, struct commitinfo *ci, const char *tag)
+uring_flush(void)
 {
-	fputs("<entry>\n", fp);
+	while (uring.inflight)
+		uring_wait();
+}
+#endif
 
-	fprintf(fp, "<id>%s</id>\n", ci->oid);
-	if (ci->author) {
-		fputs("<published>", fp);
-		printtimez(fp, &(ci->author->when));
-		fputs("</published>\n", fp);
-	}
-	if (ci->committer) {
-		fputs("<updated>", fp);
-		printtimez(fp, &(ci->committer->when));
-		fputs("</updated>\n", fp);
+/* write the data of an output file, the buffer is freed. With io_uring
+   the files are written in batches, outflush() waits for them. */
+void
+outwrite(const char *path, char *buf, size_t len)
+{
+	if (archive) {
+		pack_write(path, buf, len);
+		free(buf);
+		return;
 	}
-	if (ci->summary) {
-		fputs("<title type=\"text\">", fp);
-		if (tag && tag[0]) {
-			fputs("[", fp);
-			xmlencode(fp, tag, strlen(tag));
-			fputs("] ", fp);
+#ifdef USE_IO_URING
+	if (uringdepth > 0 && !uringfailed) {
+		if (uring.fd == -1 && uring_init() == -1)
+			uringfailed = 1;
+		else {
+			uring_write(path, buf, len);
+			return;
 		}
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</title>\n", fp);
-	}
-	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"commit/%s.html\" />\n",
-	        ci->oid);
-
-	if (ci->author) {
-		fputs("<author>\n<name>", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs("</name>\n<email>", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("</email>\n</author>\n", fp);
 	}
+#endif
+	writeatomic(path, buf, len);
+	free(buf);
+}
 
-	fputs("<content type=\"text\">", fp);
-	fprintf(fp, "commit %s\n", ci->oid);
-	if (ci->parentoid[0])
-		fprintf(fp, "parent %s\n", ci->parentoid);
-	if (ci->author) {
-		fputs("Author: ", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs(" &lt;", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("&gt;\nDate:   ", fp);
-		printtime(fp, &(ci->author->when));
-		fputc('\n', fp);
-	}
-	if (ci->msg) {
-		fputc('\n', fp);
-		xmlencode(fp, ci->msg, strlen(ci->msg));
-	}
-	fputs("\n</content>\n</entry>\n", fp);
+/* wait until all output files are written */
+void
+outflush(void)
+{
+#ifdef USE_IO_URING
+	if (uring.fd != -1)
+		uring_flush();
+#endif
 }
 
+/* write all of buf to fd, returns -1 on error */
 int
-writeatom(FILE *fp, int all)
+writeall(int fd, const char *buf, size_t len)
 {
-	struct referenceinfo *ris = NULL;
-	size_t refcount = 0;
-	struct commitinfo *ci;
-	git_revwalk *w = NULL;
-	git_oid id;
-	size_t i, m = 100; /* last 'm' commits */
-
-	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	fputs(", branch HEAD</title>\n<subtitle>", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</subtitle>\n", fp);
+	ssize_t r;
 
-	/* all commits or only tags? */
-	if (all) {
-		git_revwalk_new(&w, repo);
-		git_revwalk_push_head(w);
-		git_revwalk_simplify_first_parent(w);
-		for (i = 0; i < m && !git_revwalk_next(&id, w); i++) {
-			if (!(ci = commitinfo_getbyoid(&id)))
-				break;
-			printcommitatom(fp, ci, "");
-			commitinfo_free(ci);
+	for (; len > 0; buf += r, len -= r) {
+		if ((r = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			return -1;
 		}
-		git_revwalk_free(w);
-	} else if (getrefs(&ris, &refcount) != -1) {
-		/* references: tags */
-		for (i = 0; i < refcount; i++) {
-			if (git_reference_is_tag(ris[i].ref))
-				printcommitatom(fp, ris[i].ci,
-				                git_reference_shorthand(ris[i].ref));
+	}
 
-			commitinfo_free(ris[i].ci);
-			git_reference_free(ris[i].ref);
+	return 0;
+}
+
+/* read len bytes from fd, returns the number of bytes read: less at the
+   end of the file, or -1 on error */
+ssize_t
+readall(int fd, char *buf, size_t len)
+{
+	size_t n = 0;
+	ssize_t r;
+
+	while (n < len) {
+		if ((r = read(fd, buf + n, len - n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
-		free(ris);
+		if (r == 0)
+			break;
+		n += r;
 	}
 
-	fputs("</feed>\n", fp);
+	return n;
+}
 
-	return 0;
+/* send a changed page of a child process to the parent, without buf only
+   the name is sent: it marks a job of the child as done */
+void
+outsend(const char *path, const char *buf, size_t len)
+{
+	size_t hdr[2];
+
+	hdr[0] = strlen(path);
+	hdr[1] = buf ? len : (size_t)-1;
+	if (writeall(outpipe, (const char *)hdr, sizeof(hdr)) ||
+	    writeall(outpipe, path, hdr[0]) ||
+	    (buf && writeall(outpipe, buf, len)))
+		err(1, "write: '%s'", path);
 }
 
+/* receive a page of a child process and write it, returns 0 at the end.
+   for the name of a job that is done 2 is returned, it is in done. */
 int
-writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t filesize)
+outrecv(int fd, char *done, size_t donesize)
 {
-	char tmp[PATH_MAX] = "", *d;
-	const char *p;
-	int lc = 0;
-	FILE *fp;
+	char path[PATH_MAX], *buf;
+	size_t hdr[2];
+	ssize_t r;
+
+	if ((r = readall(fd, (char *)hdr, sizeof(hdr))) <= 0)
+		return 0;
+	if (r != sizeof(hdr) || hdr[0] >= sizeof(path) ||
+	    readall(fd, path, hdr[0]) != (ssize_t)hdr[0])
+		errx(1, "read: invalid page of a child process");
+	path[hdr[0]] = '\0';
+	if (hdr[1] == (size_t)-1) {
+		if (strlcpy(done, path, donesize) >= donesize)
+			errx(1, "path truncated: '%s'", path);
+		return 2;
+	}
+	if (!(buf = malloc(hdr[1] ? hdr[1] : 1)))
+		err(1, "malloc");
+	if (readall(fd, buf, hdr[1]) != (ssize_t)hdr[1])
+		errx(1, "read: '%s': truncated", path);
+	outwrite(path, buf, hdr[1]);
+	noutfiles++;
+	noutchanged++;
+
+	return 1;
+}
 
-	if (strlcpy(tmp, fpath, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", fpath);
-	if (!(d = dirname(tmp)))
-		err(1, "dirname");
-	if (mkdirp(d))
-		return -1;
+struct output *
+outopen(const char *path)
+{
+	struct output *o;
 
-	for (p = fpath, tmp[0] = '\0'; *p; p++) {
-		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
-			errx(1, "path truncated: '../%s'", tmp);
-	}
-	relpath = tmp;
+	if (!(o = calloc(1, sizeof(*o))))
+		err(1, "calloc");
+	if (strlcpy(o->path, path, sizeof(o->path)) >= sizeof(o->path))
+		errx(1, "path truncated: '%s'", path);
+	if (!(o->fp = open_memstream(&(o->buf), &(o->len))))
+		err(1, "open_memstream: '%s'", path);
 
-	fp = efopen(fpath, "w");
-	writeheader(fp, filename);
-	fputs("<p> ", fp);
-	xmlencode(fp, filename, strlen(filename));
-	fprintf(fp, " (%juB)", (uintmax_t)filesize);
-	fputs("</p><hr/>", fp);
+	return o;
+}
 
-	if (git_blob_is_binary((git_blob *)obj)) {
-		fputs("<p>Binary file.</p>\n", fp);
+/* finish the output file: only (atomically) replace it when it changed. */
+void
+outclose(struct output *o)
+{
+	if (ferror(o->fp) || fclose(o->fp))
+		err(1, "fwrite: '%s'", o->path);
+	noutfiles++;
+	if (samecontent(o->path, o->buf, o->len)) {
+		free(o->buf);
+	} else if (outpipe != -1) {
+		/* a child process, see writestalecommits() */
+		outsend(o->path, o->buf, o->len);
+		free(o->buf);
 	} else {
-		lc = writeblobhtml(fp, (git_blob *)obj);
-		if (ferror(fp))
-			err(1, "fwrite");
+		outwrite(o->path, o->buf, o->len);
+		noutchanged++;
 	}
-	writefooter(fp);
-	fclose(fp);
+	free(o);
+}
 
-	relpath = "";
+/* Escape characters below as HTML 2.0 / XML 1.0. */
+void
+xmlencode(FILE *fp, const char *s, size_t len)
+{
+	size_t i;
 
-	return lc;
+	for (i = 0; *s && i < len; s++, i++) {
+		switch(*s) {
+		case '<':  fputs("&lt;",   fp); break;
+		case '>':  fputs("&gt;",   fp); break;
+		case '\'': fputs("&#39;",  fp); break;
+		case '&':  fputs("&amp;",  fp); break;
+		case '"':  fputs("&quot;", fp); break;
+		default:   fputc(*s, fp);
+		}
+	}
 }
 
-const char *
-filemode(git_filemode_t m)
+/* format n in decimal to buf, which must have room for 20 bytes.
+   returns the length, buf is not NUL-terminated. */
+size_t
+numtostr(char *buf, uintmax_t n)
 {
-	static char mode[11];
+	char tmp[20], *p = tmp + sizeof(tmp);
+	size_t len;
 
-	memset(mode, '-', sizeof(mode) - 1);
-	mode[10] = '\0';
+	do {
+		*--p = '0' + (n % 10);
+		n /= 10;
+	} while (n);
+	len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
 
-	if (S_ISREG(m))
-		mode[0] = '-';
-	else if (S_ISBLK(m))
-		mode[0] = 'b';
-	else if (S_ISCHR(m))
-		mode[0] = 'c';
-	else if (S_ISDIR(m))
+	return len;
+}
+
+void
+printnum(FILE *fp, uintmax_t n)
+{
+	char buf[20];
+
+	fwrite(buf, 1, numtostr(buf, n), fp);
+}
+
+/* write a line number anchor of a file page */
+void
+printlineno(FILE *fp, size_t n)
+{
+	char buf[128], num[20];
+	size_t i, len, nlen;
+
+	nlen = numtostr(num, n);
+	memcpy(buf, "<a href=\"#l", len = 11);
+	memcpy(buf + len, num, nlen);
+	len += nlen;
+	memcpy(buf + len, "\" class=\"line\" id=\"l", 20);
+	len += 20;
+	memcpy(buf + len, num, nlen);
+	len += nlen;
+	memcpy(buf + len, "\">", 2);
+	len += 2;
+	/* right-aligned to 7 columns */
+	for (i = nlen; i < 7; i++)
+		buf[len++] = ' ';
+	memcpy(buf + len, num, nlen);
+	len += nlen;
+	memcpy(buf + len, "</a> ", 5);
+	len += 5;
+	fwrite(buf, 1, len, fp);
+}
+
+/* format the anchor id of a diff hunk "h<i>-<j>" or of a line in a hunk
+   "h<i>-<j>-<k>" to buf, which must have room for 64 bytes. returns the
+   length, buf is not NUL-terminated. */
+size_t
+hunkid(char *buf, size_t i, size_t j, size_t k, int isline)
+{
+	size_t len = 0;
+
+	buf[len++] = 'h';
+	len += numtostr(buf + len, i);
+	buf[len++] = '-';
+	len += numtostr(buf + len, j);
+	if (isline) {
+		buf[len++] = '-';
+		len += numtostr(buf + len, k);
+	}
+
+	return len;
+}
+
+/* formatted timestamps, many times are written more than once */
+enum { TimeShort, TimeZ, TimeFull };
+
+struct timecacheentry {
+	git_time_t time;
+	int offset;
+	int fmt;
+	size_t len;
+	char s[40];
+};
+
+static struct timecacheentry timecache[256];
+
+static const char *wdays[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char *months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+void
+put2(char *p, int n)
+{
+	p[0] = '0' + (n / 10) % 10;
+	p[1] = '0' + n % 10;
+}
+
+/* convert seconds since the epoch to UTC: like gmtime(), but without
+   locale, timezone lookups or a static result. returns -1 if the year is
+   out of range. */
+int
+epochtotm(long long t, struct tm *tm)
+{
+	long long days, era, doe, yoe, doy, mp, y;
+	long long secs;
+
+	days = t / 86400;
+	if ((secs = t % 86400) < 0) {
+		secs += 86400;
+		days--;
+	}
+	tm->tm_hour = secs / 3600;
+	tm->tm_min = (secs / 60) % 60;
+	tm->tm_sec = secs % 60;
+	tm->tm_wday = ((days % 7) + 11) % 7; /* 1970-01-01 is a Thursday */
+
+	/* days to civil date */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	tm->tm_mday = doy - (153 * mp + 2) / 5 + 1;
+	tm->tm_mon = mp < 10 ? mp + 2 : mp - 10;
+	y += tm->tm_mon <= 1;
+	if (y < 0 || y > 9999)
+		return -1;
+	tm->tm_year = y - 1900;
+
+	return 0;
+}
+
+/* format a git time as (fmt):
+   TimeShort: "%Y-%m-%d %H:%M"
+   TimeZ:     "%Y-%m-%dT%H:%M:%SZ"
+   TimeFull:  "%a, %e %b %Y %H:%M:%S +hhmm" with the time in its offset.
+   returns NULL when the time cannot be represented. */
+const char *
+fmttime(const git_time *intime, int fmt, size_t *len)
+{
+	struct timecacheentry *e;
+	struct tm tm;
+	char *p;
+	int off, y;
+
+	e = &timecache[((uint64_t)intime->time * 31 + intime->offset * 7 + fmt) %
+	               (sizeof(timecache) / sizeof(*timecache))];
+	if (e->len && e->time == intime->time && e->offset == intime->offset &&
+	    e->fmt == fmt) {
+		*len = e->len;
+		return e->s;
+	}
+
+	off = fmt == TimeFull ? intime->offset : 0;
+	if (epochtotm((long long)intime->time + off * 60, &tm) == -1)
+		return NULL;
+	y = tm.tm_year + 1900;
+
+	p = e->s;
+	if (fmt == TimeFull) {
+		memcpy(p, wdays[tm.tm_wday], 3);
+		memcpy(p + 3, ", ", 2);
+		put2(p + 5, tm.tm_mday);
+		if (p[5] == '0')
+			p[5] = ' ';
+		p[7] = ' ';
+		memcpy(p + 8, months[tm.tm_mon], 3);
+		p[11] = ' ';
+		put2(p + 12, y / 100);
+		put2(p + 14, y % 100);
+		p[16] = ' ';
+		p += 17;
+	} else {
+		put2(p, y / 100);
+		put2(p + 2, y % 100);
+		p[4] = '-';
+		put2(p + 5, tm.tm_mon + 1);
+		p[7] = '-';
+		put2(p + 8, tm.tm_mday);
+		p[10] = fmt == TimeZ ? 'T' : ' ';
+		p += 11;
+	}
+	put2(p, tm.tm_hour);
+	p[2] = ':';
+	put2(p + 3, tm.tm_min);
+	p += 5;
+	if (fmt != TimeShort) {
+		*p++ = ':';
+		put2(p, tm.tm_sec);
+		p += 2;
+	}
+	if (fmt == TimeZ) {
+		*p++ = 'Z';
+	} else if (fmt == TimeFull) {
+		off = intime->offset < 0 ? -intime->offset : intime->offset;
+		*p++ = ' ';
+		*p++ = intime->offset < 0 ? '-' : '+';
+		put2(p, off / 60);
+		put2(p + 2, off % 60);
+		p += 4;
+	}
+
+	e->time = intime->time;
+	e->offset = intime->offset;
+	e->fmt = fmt;
+	e->len = p - e->s;
+	*len = e->len;
+
+	return e->s;
+}
+
+void
+printtimez(FILE *fp, const git_time *intime)
+{
+	const char *s;
+	size_t len;
+
+	if ((s = fmttime(intime, TimeZ, &len)))
+		fwrite(s, 1, len, fp);
+}
+
+void
+printtime(FILE *fp, const git_time *intime)
+{
+	const char *s;
+	size_t len;
+
+	if ((s = fmttime(intime, TimeFull, &len)))
+		fwrite(s, 1, len, fp);
+}
+
+void
+printtimeshort(FILE *fp, const git_time *intime)
+{
+	const char *s;
+	size_t len;
+
+	if ((s = fmttime(intime, TimeShort, &len)))
+		fwrite(s, 1, len, fp);
+}
+
+void
+writeheader(FILE *fp, const char *title)
+{
+	fputs("<!DOCTYPE html>\n"
+		"<html>\n<head>\n"
+		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
+		"<title>", fp);
+	xmlencode(fp, title, strlen(title));
+	if (title[0] && strippedname[0])
+		fputs(" - ", fp);
+	xmlencode(fp, strippedname, strlen(strippedname));
+	if (description[0])
+		fputs(" - ", fp);
+	xmlencode(fp, description, strlen(description));
+	fprintf(fp, "</title>\n<link rel=\"icon\" type=\"image/png\" href=\"%sfavicon.png\" />\n", relpath);
+	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed\" href=\"%satom.xml\" />\n",
+		name, relpath);
+	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed (tags)\" href=\"%stags.xml\" />\n",
+		name, relpath);
+	fprintf(fp, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%sstyle.css\" />\n", relpath);
+	fputs("</head>\n<body>\n<table><tr><td>", fp);
+	fprintf(fp, "<a href=\"../%s\"><img src=\"%slogo.png\" alt=\"\" width=\"32\" height=\"32\" /></a>",
+	        relpath, relpath);
+	fputs("</td><td><h1>", fp);
+	xmlencode(fp, strippedname, strlen(strippedname));
+	fputs("</h1><span class=\"desc\">", fp);
+	xmlencode(fp, description, strlen(description));
+	fputs("</span></td></tr>", fp);
+	if (cloneurl[0]) {
+		fputs("<tr class=\"url\"><td></td><td>git clone <a href=\"", fp);
+		xmlencode(fp, cloneurl, strlen(cloneurl));
+		fputs("\">", fp);
+		xmlencode(fp, cloneurl, strlen(cloneurl));
+		fputs("</a></td></tr>", fp);
+	}
+	fputs("<tr><td></td><td>\n", fp);
+	fprintf(fp, "<a href=\"%slog.html\">Log</a> | ", relpath);
+	fprintf(fp, "<a href=\"%sfiles.html\">Files</a> | ", relpath);
+	fprintf(fp, "<a href=\"%srefs.html\">Refs</a>", relpath);
+	if (submodules)
+		fprintf(fp, " | <a href=\"%sfile/%s.html\">Submodules</a>",
+		        relpath, submodules);
+	if (readme)
+		fprintf(fp, " | <a href=\"%sfile/%s.html\">README</a>",
+		        relpath, readme);
+	if (license)
+		fprintf(fp, " | <a href=\"%sfile/%s.html\">LICENSE</a>",
+		        relpath, license);
+	if (searchindex)
+		fprintf(fp, " | <a href=\"%ssearch.html\">Search</a>", relpath);
+	if (statspage)
+		fprintf(fp, " | <a href=\"%sstats.html\">Stats</a>", relpath);
+	fputs("</td></tr></table>\n<hr/>\n<div id=\"content\">\n", fp);
+}
+
+void
+writefooter(FILE *fp)
+{
+	fputs("</div>\n</body>\n</html>\n", fp);
+}
+
+/* the number of lines of a blob that are rendered within the limits of
+   blobbytes and bloblines, *shown is set to their size in bytes */
+size_t
+blobshownlines(const char *s, size_t len, size_t *shown)
+{
+	size_t n = 0, i, prev, end;
+
+	/* each line including trailing data without a newline */
+	for (i = 0, prev = 0; prev < len; i++) {
+		if (i < len && s[i] != '\n')
+			continue;
+		end = i < len ? i + 1 : len;
+		if ((maxbloblines && n >= (size_t)maxbloblines) ||
+		    (maxblobbytes && end > (size_t)maxblobbytes))
+			break;
+		n++;
+		prev = end;
+	}
+	*shown = prev;
+
+	return n;
+}
+
+/* over the limit: only count the remaining lines, do not render them.
+   returns the number of lines of the blob */
+size_t
+writeblobtruncated(FILE *fp, const char *s, size_t len, size_t shown,
+	size_t n)
+{
+	const char *p;
+
+	if (shown >= len)
+		return n;
+	fprintf(fp, "<p>File truncated, only the first %zu lines are shown", n);
+	for (p = &s[shown]; (p = memchr(p, '\n', &s[len] - p)); p++)
+		n++;
+	if (s[len - 1] != '\n')
+		n++;
+	fprintf(fp, " of %zu lines.</p>\n", n);
+
+	return n;
+}
+
+int
+writeblobhtml(FILE *fp, const git_blob *blob)
+{
+	size_t n = 0, nshown, i, prev, end, shown;
+	const char *s = git_blob_rawcontent(blob);
+	git_off_t len = git_blob_rawsize(blob);
+
+	nshown = blobshownlines(s, len, &shown);
+	fputs("<pre id=\"blob\">\n", fp);
+
+	/* each line including trailing data without a newline */
+	for (i = 0, prev = 0; prev < shown; i++) {
+		if (i < shown && s[i] != '\n')
+			continue;
+		end = i < shown ? i + 1 : shown;
+		n++;
+		printlineno(fp, n);
+		xmlencode(fp, &s[prev], end - prev);
+		prev = end;
+	}
+
+	fputs("</pre>\n", fp);
+
+	return writeblobtruncated(fp, s, len, shown, nshown);
+}
+
+void
+printcommit(FILE *fp, struct commitinfo *ci)
+{
+	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n",
+		relpath, ci->oid, ci->oid);
+
+	if (ci->parentoid[0])
+		fprintf(fp, "<b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n",
+			relpath, ci->parentoid, ci->parentoid);
+
+	if (ci->author) {
+		fputs("<b>Author:</b> ", fp);
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+		fputs(" &lt;<a href=\"mailto:", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("\">", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("</a>&gt;\n<b>Date:</b>   ", fp);
+		printtime(fp, &(ci->author->when));
+		fputc('\n', fp);
+	}
+	if (ci->msg) {
+		fputc('\n', fp);
+		xmlencode(fp, ci->msg, strlen(ci->msg));
+		fputc('\n', fp);
+	}
+}
+
+/* write the "diff --git" line of the i-th file of a diff */
+void
+printdiffhead(FILE *fp, const git_diff_delta *delta, size_t i)
+{
+	fputs("<b>diff --git a/<a id=\"h", fp);
+	printnum(fp, i);
+	fprintf(fp, "\" href=\"%sfile/", relpath);
+	xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fputs(".html\">", fp);
+	xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
+	xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, ".html\">");
+	xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, "</a></b>\n");
+}
+
+/* write the hunks of the patch of the i-th file of a diff */
+void
+printpatch(FILE *fp, git_patch *patch, size_t i)
+{
+	const git_diff_hunk *hunk;
+	const git_diff_line *line;
+	size_t nhunks, nhunklines, j, k, idlen;
+	char id[64];
+
+	nhunks = git_patch_num_hunks(patch);
+	for (j = 0; j < nhunks; j++) {
+		if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
+			break;
+
+		idlen = hunkid(id, i, j, 0, 0);
+		fputs("<a href=\"#", fp);
+		fwrite(id, 1, idlen, fp);
+		fputs("\" id=\"", fp);
+		fwrite(id, 1, idlen, fp);
+		fputs("\" class=\"h\">", fp);
+		xmlencode(fp, hunk->header, hunk->header_len);
+		fputs("</a>", fp);
+
+		for (k = 0; ; k++) {
+			if (git_patch_get_line_in_hunk(&line, patch, j, k))
+				break;
+			if (line->old_lineno == -1 || line->new_lineno == -1) {
+				idlen = hunkid(id, i, j, k, 1);
+				fputs("<a href=\"#", fp);
+				fwrite(id, 1, idlen, fp);
+				fputs("\" id=\"", fp);
+				fwrite(id, 1, idlen, fp);
+				fputs(line->old_lineno == -1 ?
+				      "\" class=\"i\">+" : "\" class=\"d\">-", fp);
+			} else {
+				fputc(' ', fp);
+			}
+			xmlencode(fp, line->content, line->content_len);
+			if (line->old_lineno == -1 || line->new_lineno == -1)
+				fputs("</a>", fp);
+		}
+	}
+}
+
+void
+printshowfile(FILE *fp, struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	struct deltainfo *di;
+	git_patch *patch;
+	size_t changed, add, del, total, nuncounted = 0, i;
+	char linestr[80];
+	double t;
+	int c, r;
+
+	printcommit(fp, ci);
+
+	if (!ci->deltas)
+		return;
+
+	if (difffiles && ci->ndeltas > (size_t)difffiles) {
+		fputs("Diff is too large, output suppressed.\n", fp);
+		return;
+	}
+
+	/* diff stat */
+	fputs("<b>Diffstat:</b>\n<table>", fp);
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = git_diff_get_delta(ci->diff, i);
+
+		switch (delta->status) {
+		case GIT_DELTA_ADDED:      c = 'A'; break;
+		case GIT_DELTA_COPIED:     c = 'C'; break;
+		case GIT_DELTA_DELETED:    c = 'D'; break;
+		case GIT_DELTA_MODIFIED:   c = 'M'; break;
+		case GIT_DELTA_RENAMED:    c = 'R'; break;
+		case GIT_DELTA_TYPECHANGE: c = 'T'; break;
+		default:                   c = ' '; break;
+		}
+		if (c == ' ')
+			fprintf(fp, "<tr><td>%c", c);
+		else
+			fprintf(fp, "<tr><td class=\"%c\">%c", c, c);
+
+		fputs("</td><td><a href=\"#h", fp);
+		printnum(fp, i);
+		fputs("\">", fp);
+		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+		if (strcmp(delta->old_file.path, delta->new_file.path)) {
+			fputs(" -&gt; ", fp);
+			xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+		}
+
+		/* the lines of a patch that is not generated are not counted */
+		if (ci->deltas[i]->minbytes) {
+			nuncounted++;
+			fputs("</a></td><td> | </td><td class=\"num\">?</td>"
+			      "<td></td></tr>\n", fp);
+			continue;
+		}
+		add = ci->deltas[i]->addcount;
+		del = ci->deltas[i]->delcount;
+		changed = add + del;
+		total = sizeof(linestr) - 2;
+		if (changed > total) {
+			if (add)
+				add = ((float)total / changed * add) + 1;
+			if (del)
+				del = ((float)total / changed * del) + 1;
+		}
+		memset(&linestr, '+', add);
+		memset(&linestr[add], '-', del);
+
+		fputs("</a></td><td> | </td><td class=\"num\">", fp);
+		printnum(fp, ci->deltas[i]->addcount + ci->deltas[i]->delcount);
+		fputs("</td><td><span class=\"i\">", fp);
+		fwrite(&linestr, 1, add, fp);
+		fputs("</span><span class=\"d\">", fp);
+		fwrite(&linestr[add], 1, del, fp);
+		fputs("</span></td></tr>\n", fp);
+	}
+	fprintf(fp, "</table></pre><pre>%zu file%s changed, %zu insertion%s(+), %zu deletion%s(-)\n",
+		ci->filecount, ci->filecount == 1 ? "" : "s",
+	        ci->addcount,  ci->addcount  == 1 ? "" : "s",
+	        ci->delcount,  ci->delcount  == 1 ? "" : "s");
+	if (nuncounted)
+		fprintf(fp, "The lines of %zu file%s over a limit are not counted.\n",
+		        nuncounted, nuncounted == 1 ? "" : "s");
+	if (ci->renamepairs)
+		fprintf(fp, "Rename and copy detection skipped, %zu candidate pairs.\n",
+		        ci->renamepairs);
+
+	fputs("<hr/>", fp);
+
+	for (i = 0; i < ci->ndeltas; i++) {
+		di = ci->deltas[i];
+		delta = git_diff_get_delta(ci->diff, i);
+		printdiffhead(fp, delta, i);
+
+		/* over a limit: only the diffstat row, the patch is not generated,
+		   see commitinfo_getstats() */
+		changed = di->addcount + di->delcount;
+		if (di->over && di->minbytes) {
+			fprintf(fp, "Diff not shown, at least %zu bytes are over the "
+			        "limit of a %s.\n", di->minbytes, di->over);
+			continue;
+		}
+		if (di->over) {
+			fprintf(fp, "Diff not shown, %zu changed line%s and %zu bytes "
+			        "are over the limit of a %s.\n", changed,
+			        changed == 1 ? "" : "s", di->bytes, di->over);
+			continue;
+		}
+		if (di->split) {
+			fprintf(fp, "Diff of %zu changed line%s on its own page: "
+			        "<a href=\"%s/%zu.html\">%s/%zu.html</a>\n", changed,
+			        changed == 1 ? "" : "s", ci->oid, i, ci->oid, i);
+			continue;
+		}
+
+		/* when streaming only one patch is in memory at a time */
+		if (!(patch = di->patch)) {
+			t = costtime();
+			r = git_patch_from_diff(&patch, ci->diff, i);
+			cost.patch += costtime() - t;
+			if (r)
+				break;
+		}
+		delta = git_patch_get_delta(patch);
+
+		/* check binary data */
+		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+			fputs("Binary files differ.\n", fp);
+			if (patch != di->patch)
+				git_patch_free(patch);
+			continue;
+		}
+
+		printpatch(fp, patch, i);
+		if (patch != di->patch)
+			git_patch_free(patch);
+	}
+}
+
+/* number of threads for parallel work, see the jobs limit */
+long
+nthreads(void)
+{
+	long n;
+
+	if (jobs)
+		return jobs;
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+
+	return n;
+}
+
+/* pages of the split files of a commit, rendered by threads */
+struct diffpages {
+	struct commitinfo *ci;
+	size_t *files;          /* index of the file of each page */
+	git_diff_delta *deltas; /* of each page, copied by the main thread */
+	struct output **outs;   /* rendered pages */
+	size_t n;
+	size_t next;          /* next page to render */
+	pthread_mutex_t lock;
+};
+
+/* render the page "commit/<oid>/<i>.html" of the i-th file of a commit.
+   the patch is generated from the blobs with the options of the diff of
+   the commit: threads share no diff state. */
+struct output *
+renderdiffpage(struct commitinfo *ci, size_t i, const git_diff_delta *delta)
+{
+	git_diff_options opts;
+	git_blob *oldblob = NULL, *newblob = NULL;
+	git_patch *patch = NULL;
+	struct output *o;
+	char path[PATH_MAX];
+	int r;
+
+	r = snprintf(path, sizeof(path), "commit/%s/%zu.html", ci->oid, i);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'commit/%s/%zu.html'", ci->oid, i);
+	o = outopen(path);
+
+	commitdiffoptions(&opts);
+	writeheader(o->fp, ci->summary);
+	fprintf(o->fp, "<pre><b>commit</b> <a href=\"../%s.html\">%s</a>\n",
+	        ci->oid, ci->oid);
+	printdiffhead(o->fp, delta, i);
+	if ((!git_oid_iszero(&(delta->old_file.id)) &&
+	     git_blob_lookup(&oldblob, repo, &(delta->old_file.id))) ||
+	    (!git_oid_iszero(&(delta->new_file.id)) &&
+	     git_blob_lookup(&newblob, repo, &(delta->new_file.id))) ||
+	    git_patch_from_blobs(&patch, oldblob, delta->old_file.path,
+	                         newblob, delta->new_file.path, &opts))
+		fputs("Diff could not be generated.\n", o->fp);
+	else
+		printpatch(o->fp, patch, i);
+	fputs("</pre>\n", o->fp);
+	writefooter(o->fp);
+
+	git_patch_free(patch);
+	git_blob_free(oldblob);
+	git_blob_free(newblob);
+
+	return o;
+}
+
+void *
+diffpages_worker(void *arg)
+{
+	struct diffpages *dp = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&(dp->lock));
+		i = dp->next++;
+		pthread_mutex_unlock(&(dp->lock));
+		if (i >= dp->n)
+			break;
+		dp->outs[i] = renderdiffpage(dp->ci, dp->files[i], &(dp->deltas[i]));
+	}
+
+	return NULL;
+}
+
+/* write the pages of the files that were split from the page of a commit,
+   see printshowfile(). the pages are rendered in parallel, a few per
+   thread at a time to bound the memory, and written by the main thread. */
+void
+writediffpages(struct commitinfo *ci)
+{
+	struct diffpages dp;
+	pthread_t *threads;
+	const char *rp = relpath;
+	char dir[PATH_MAX];
+	git_diff_delta *deltas;
+	size_t *files, ndeltas, batch, b, i;
+	long n, t;
+	int r;
+
+	for (i = ndeltas = 0; i < ci->ndeltas; i++)
+		ndeltas += ci->deltas[i]->split;
+	if (!ndeltas)
+		return;
+	if (!(files = reallocarray(NULL, ndeltas, sizeof(*files))) ||
+	    !(deltas = reallocarray(NULL, ndeltas, sizeof(*deltas))))
+		err(1, "reallocarray");
+	/* the diff is not shared with the threads: copy the deltas here */
+	for (i = ndeltas = 0; i < ci->ndeltas; i++) {
+		if (!ci->deltas[i]->split)
+			continue;
+		files[ndeltas] = i;
+		deltas[ndeltas++] = *git_diff_get_delta(ci->diff, i);
+	}
+
+	r = snprintf(dir, sizeof(dir), "commit/%s", ci->oid);
+	if (r < 0 || (size_t)r >= sizeof(dir))
+		errx(1, "path truncated: 'commit/%s'", ci->oid);
+	if (outmkdir(dir))
+		err(1, "mkdir: '%s'", dir);
+
+	n = nthreads();
+	batch = n * 4;
+	if (!(threads = reallocarray(NULL, n, sizeof(*threads))) ||
+	    !(dp.outs = reallocarray(NULL, batch, sizeof(*dp.outs))))
+		err(1, "reallocarray");
+	pthread_mutex_init(&(dp.lock), NULL);
+	dp.ci = ci;
+
+	relpath = "../../";
+	for (b = 0; b < ndeltas; b += batch) {
+		dp.files = files + b;
+		dp.deltas = deltas + b;
+		dp.n = ndeltas - b < batch ? ndeltas - b : batch;
+		dp.next = 0;
+		/* the main thread renders too */
+		for (t = 0; t + 1 < n && (size_t)t + 1 < dp.n; t++) {
+			if ((r = pthread_create(&threads[t], NULL, diffpages_worker, &dp))) {
+				errno = r;
+				err(1, "pthread_create");
+			}
+		}
+		diffpages_worker(&dp);
+		while (t > 0)
+			pthread_join(threads[--t], NULL);
+		for (i = 0; i < dp.n; i++)
+			outclose(dp.outs[i]);
+	}
+	relpath = rp;
+
+	pthread_mutex_destroy(&(dp.lock));
+	free(dp.outs);
+	free(threads);
+	free(files);
+	free(deltas);
+}
+
+/* add a commit to the file history, returns its index */
+size_t
+histcommit_add(const git_oid *id)
+{
+	if (nhistcommits && git_oid_equal(&histcommits[nhistcommits - 1], id))
+		return nhistcommits - 1;
+	if (nhistcommits + 1 > histcommitscap) {
+		histcommitscap = histcommitscap ? histcommitscap * 2 : 1024;
+		if (!(histcommits = reallocarray(histcommits, histcommitscap,
+		                                  sizeof(*histcommits))))
+			err(1, "realloc");
+	}
+	histcommits[nhistcommits] = *id;
+
+	return nhistcommits++;
+}
+
+void
+pathhist_add(const char *path, size_t commit, size_t add, size_t del, int changed)
+{
+	struct strtabentry *e;
+	struct pathhist *ph;
+
+	e = strtab_get(&histpaths, path);
+	if (!e->data && !(e->data = calloc(1, sizeof(struct pathhist))))
+		err(1, "calloc");
+	ph = e->data;
+	if (ph->ncommits && ph->commits[ph->ncommits - 1].commit == commit)
+		return;
+	if (ph->ncommits + 1 > ph->cap) {
+		ph->cap = ph->cap ? ph->cap * 2 : 4;
+		if (!(ph->commits = reallocarray(ph->commits, ph->cap,
+		                                 sizeof(*(ph->commits)))))
+			err(1, "realloc");
+	}
+	ph->commits[ph->ncommits].commit = commit;
+	ph->commits[ph->ncommits].addcount = add;
+	ph->commits[ph->ncommits].delcount = del;
+	ph->ncommits++;
+	ph->changed |= changed;
+}
+
+/* add the changed paths of a newly walked commit to the file history and
+   the index. lines in the index are: "<commit id> <added> <deleted> <path>" */
+void
+filehistory_addcommit(struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	const char *paths[2];
+	size_t c, i, j;
+
+	c = histcommit_add(git_commit_id(ci->commit));
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = git_diff_get_delta(ci->diff, i);
+		paths[0] = delta->new_file.path;
+		paths[1] = strcmp(delta->old_file.path, delta->new_file.path) ?
+		           delta->old_file.path : NULL;
+		for (j = 0; j < 2 && paths[j]; j++) {
+			pathhist_add(paths[j], c, ci->deltas[i]->addcount,
+			             ci->deltas[i]->delcount, 1);
+			/* a newline in a path cannot be stored in the index */
+			if (whistfp && !strchr(paths[j], '\n'))
+				fprintf(whistfp, "%s %zu %zu %s\n", ci->oid,
+				        ci->deltas[i]->addcount,
+				        ci->deltas[i]->delcount, paths[j]);
+		}
+	}
+}
+
+/* read the file history index of the previous run, copy it to the new index */
+void
+filehistory_read(FILE *fp)
+{
+	git_oid id;
+	char *line = NULL, *p, *path;
+	size_t linesiz = 0, add, del;
+	ssize_t linelen;
+
+	while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+		if (whistfp && fwrite(line, 1, linelen, whistfp) != (size_t)linelen)
+			err(1, "fwrite");
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen < GIT_OID_HEXSZ + 1 || line[GIT_OID_HEXSZ] != ' ' ||
+		    git_oid_fromstrn(&id, line, GIT_OID_HEXSZ))
+			errx(1, "%s: invalid line", histfile);
+		errno = 0;
+		add = strtoull(line + GIT_OID_HEXSZ + 1, &p, 10);
+		if (*p != ' ')
+			errx(1, "%s: invalid line", histfile);
+		del = strtoull(p + 1, &path, 10);
+		if (*path != ' ' || errno)
+			errx(1, "%s: invalid line", histfile);
+		pathhist_add(path + 1, histcommit_add(&id), add, del, 0);
+	}
+	if (ferror(fp))
+		err(1, "getline: '%s'", histfile);
+	free(line);
+}
+
+/* last commit that changed path or NULL */
+const git_oid *
+filehistory_last(const char *path)
+{
+	struct strtabentry *e;
+
+	if (!(e = strtab_find(&histpaths, path)) || !e->key)
+		return NULL;
+
+	return &histcommits[((struct pathhist *)e->data)->commits[0].commit];
+}
+
+/* write history pages "history/<path>.html" of changed paths, or of all
+   paths when all is set. only the files of head have a file page. */
+void
+writehistory(const git_oid *head, int all)
+{
+	struct output *o;
+	struct pathhist *ph;
+	git_commit *commit = NULL;
+	git_tree *tree = NULL;
+	git_tree_entry *entry;
+	const git_signature *author;
+	const char *name, *summary, *p;
+	char path[PATH_MAX], rel[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1], *d;
+	size_t i, j;
+	int r, infile;
+
+	if (head && !git_commit_lookup(&commit, repo, head))
+		git_commit_tree(&tree, commit);
+	git_commit_free(commit);
+
+	for (i = 0; i < histpaths.cap; i++) {
+		if (!histpaths.entries[i].key)
+			continue;
+		name = histpaths.entries[i].key;
+		ph = histpaths.entries[i].data;
+		if (!all && !ph->changed)
+			continue;
+
+		r = snprintf(path, sizeof(path), "history/%s.html", name);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'history/%s.html'", name);
+		if (strlcpy(rel, path, sizeof(rel)) >= sizeof(rel))
+			errx(1, "path truncated: '%s'", path);
+		if (!(d = dirname(rel)))
+			err(1, "dirname");
+		if (outmkdir(d))
+			err(1, "mkdir: '%s'", d);
+		for (p = path, rel[0] = '\0'; *p; p++) {
+			if (*p == '/' && strlcat(rel, "../", sizeof(rel)) >= sizeof(rel))
+				errx(1, "path truncated: '../%s'", rel);
+		}
+		relpath = rel;
+
+		infile = 0;
+		if (tree && !git_tree_entry_bypath(&entry, tree, name)) {
+			infile = git_tree_entry_type(entry) == GIT_OBJ_BLOB;
+			git_tree_entry_free(entry);
+		}
+
+		o = outopen(path);
+		writeheader(o->fp, name);
+		fputs("<p>History of ", o->fp);
+		if (infile) {
+			fprintf(o->fp, "<a href=\"%sfile/", relpath);
+			xmlencode(o->fp, name, strlen(name));
+			fputs(".html\">", o->fp);
+		}
+		xmlencode(o->fp, name, strlen(name));
+		if (infile)
+			fputs("</a>", o->fp);
+		fputs("</p><hr/>\n", o->fp);
+		fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
+		      "<td><b>Commit message</b></td><td><b>Author</b></td>"
+		      "<td class=\"num\" align=\"right\"><b>+</b></td>"
+		      "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n"
+		      "</thead><tbody>\n", o->fp);
+		for (j = 0; j < ph->ncommits; j++) {
+			if (git_commit_lookup(&commit, repo, &histcommits[ph->commits[j].commit]))
+				continue;
+			author = git_commit_author(commit);
+			summary = git_commit_summary(commit);
+			git_oid_tostr(oidstr, sizeof(oidstr), git_commit_id(commit));
+
+			fputs("<tr><td>", o->fp);
+			if (author)
+				printtimeshort(o->fp, &(author->when));
+			fputs("</td><td>", o->fp);
+			if (summary) {
+				fprintf(o->fp, "<a href=\"%scommit/%s.html\">", relpath, oidstr);
+				xmlencode(o->fp, summary, strlen(summary));
+				fputs("</a>", o->fp);
+			}
+			fputs("</td><td>", o->fp);
+			if (author)
+				xmlencode(o->fp, author->name, strlen(author->name));
+			fputs("</td><td class=\"num\" align=\"right\">+", o->fp);
+			printnum(o->fp, ph->commits[j].addcount);
+			fputs("</td><td class=\"num\" align=\"right\">-", o->fp);
+			printnum(o->fp, ph->commits[j].delcount);
+			fputs("</td></tr>\n", o->fp);
+			git_commit_free(commit);
+		}
+		fputs("</tbody></table>", o->fp);
+		writefooter(o->fp);
+		outclose(o);
+	}
+	relpath = "";
+	git_tree_free(tree);
+}
+
+void
+filehistory_free(void)
+{
+	struct pathhist *ph;
+	size_t i;
+
+	for (i = 0; i < histpaths.cap; i++) {
+		if (!(ph = histpaths.entries[i].data))
+			continue;
+		free(ph->commits);
+		free(ph);
+	}
+	strtab_free(&histpaths);
+	free(histcommits);
+	histcommits = NULL;
+	nhistcommits = histcommitscap = 0;
+}
+
+/* add counts to the statistics of key */
+void
+stats_add(struct strtab *t, const char *key, size_t commits, size_t add,
+	size_t del)
+{
+	struct strtabentry *e;
+	struct statcount *c;
+
+	e = strtab_get(t, key);
+	if (!e->data && !(e->data = calloc(1, sizeof(struct statcount))))
+		err(1, "calloc");
+	c = e->data;
+	c->commits += commits;
+	c->add += add;
+	c->del += del;
+}
+
+/* add the diffstat of a commit to the statistics of its author and month */
+void
+stats_addcommit(struct commitinfo *ci)
+{
+	const char *s;
+	char month[8];
+	size_t len;
+
+	if (!ci->author)
+		return;
+	stats_add(&statauthors, ci->author->name, 1, ci->addcount, ci->delcount);
+	/* "YYYY-MM" of the UTC date */
+	if ((s = fmttime(&(ci->author->when), TimeShort, &len))) {
+		memcpy(month, s, 7);
+		month[7] = '\0';
+		stats_add(&statmonths, month, 1, ci->addcount, ci->delcount);
+	}
+}
+
+void
+stats_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < statauthors.cap; i++)
+		free(statauthors.entries[i].data);
+	for (i = 0; i < statmonths.cap; i++)
+		free(statmonths.entries[i].data);
+	strtab_free(&statauthors);
+	strtab_free(&statmonths);
+}
+
+/* read the statistics of the previous run, returns -1 when they do not
+   exist, are not of the last commit of the cache or are invalid */
+int
+stats_read(const git_oid *lastid)
+{
+	FILE *fp;
+	git_oid id;
+	struct strtab *t;
+	char *line = NULL, *p, *key;
+	size_t linesiz = 0, commits, add, del;
+	ssize_t linelen;
+
+	if (!(fp = fopen(statsfile, "r")))
+		return -1;
+	if ((linelen = getline(&line, &linesiz, fp)) < GIT_OID_HEXSZ ||
+	    git_oid_fromstrn(&id, line, GIT_OID_HEXSZ) || !git_oid_equal(&id, lastid)) {
+		free(line);
+		fclose(fp);
+		return -1;
+	}
+	/* "a commits add del name" and "m commits add del YYYY-MM" lines */
+	while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen < 2 || (line[0] != 'a' && line[0] != 'm') || line[1] != ' ')
+			goto invalid;
+		t = line[0] == 'a' ? &statauthors : &statmonths;
+		errno = 0;
+		commits = strtoull(line + 2, &p, 10);
+		if (*p != ' ')
+			goto invalid;
+		add = strtoull(p + 1, &p, 10);
+		if (*p != ' ')
+			goto invalid;
+		del = strtoull(p + 1, &key, 10);
+		if (*key != ' ' || errno)
+			goto invalid;
+		stats_add(t, key + 1, commits, add, del);
+	}
+	if (ferror(fp))
+		err(1, "getline: '%s'", statsfile);
+	free(line);
+	fclose(fp);
+
+	return 0;
+
+invalid:
+	/* counted again from all commits */
+	if (verbose)
+		fprintf(stderr, "%s: invalid line, the statistics are rebuilt\n",
+		        statsfile);
+	stats_free();
+	free(line);
+	fclose(fp);
+
+	return -1;
+}
+
+/* store the statistics for the next run, head is the last commit */
+void
+stats_write(const char *head)
+{
+	struct strtab *t;
+	struct statcount *c;
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, i, j;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		err(1, "open_memstream");
+	fprintf(fp, "%s\n", head);
+	for (j = 0; j < 2; j++) {
+		t = j ? &statmonths : &statauthors;
+		for (i = 0; i < t->cap; i++) {
+			if (!(c = t->entries[i].data))
+				continue;
+			/* a newline in a name cannot be stored */
+			if (strchr(t->entries[i].key, '\n'))
+				continue;
+			fprintf(fp, "%c %zu %zu %zu %s\n", j ? 'm' : 'a',
+			        c->commits, c->add, c->del, t->entries[i].key);
+		}
+	}
+	if (fclose(fp))
+		err(1, "fclose");
+	writeatomic(statsfile, buf, len);
+	free(buf);
+}
+
+/* most commits first, then by name */
+int
+stats_authorcmp(const void *v1, const void *v2)
+{
+	const struct strtabentry *e1 = *(struct strtabentry * const *)v1;
+	const struct strtabentry *e2 = *(struct strtabentry * const *)v2;
+	const struct statcount *c1 = e1->data, *c2 = e2->data;
+
+	if (c1->commits != c2->commits)
+		return c1->commits < c2->commits ? 1 : -1;
+
+	return strcmp(e1->key, e2->key);
+}
+
+/* newest month first */
+int
+stats_monthcmp(const void *v1, const void *v2)
+{
+	const struct strtabentry *e1 = *(struct strtabentry * const *)v1;
+	const struct strtabentry *e2 = *(struct strtabentry * const *)v2;
+
+	return strcmp(e2->key, e1->key);
+}
+
+void
+writestatstable(FILE *fp, struct strtab *t, const char *title, const char *id,
+	const char *column, int (*cmp)(const void *, const void *))
+{
+	struct strtabentry **entries;
+	struct statcount *c;
+	size_t i, n;
+
+	if (!(entries = reallocarray(NULL, t->n + 1, sizeof(*entries))))
+		err(1, "reallocarray");
+	for (i = 0, n = 0; i < t->cap; i++)
+		if (t->entries[i].data)
+			entries[n++] = &(t->entries[i]);
+	qsort(entries, n, sizeof(*entries), cmp);
+
+	fprintf(fp, "<h2>%s</h2><table id=\"%s\"><thead>\n<tr><td><b>%s</b></td>"
+	        "<td class=\"num\" align=\"right\"><b>Commits</b></td>"
+	        "<td class=\"num\" align=\"right\"><b>+</b></td>"
+	        "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n"
+	        "</thead><tbody>\n", title, id, column);
+	for (i = 0; i < n; i++) {
+		c = entries[i]->data;
+		fputs("<tr><td>", fp);
+		xmlencode(fp, entries[i]->key, strlen(entries[i]->key));
+		fputs("</td><td class=\"num\" align=\"right\">", fp);
+		printnum(fp, c->commits);
+		fputs("</td><td class=\"num\" align=\"right\">+", fp);
+		printnum(fp, c->add);
+		fputs("</td><td class=\"num\" align=\"right\">-", fp);
+		printnum(fp, c->del);
+		fputs("</td></tr>\n", fp);
+	}
+	fputs("</tbody></table><br/>\n", fp);
+
+	free(entries);
+}
+
+/* page with the commits, insertions and deletions per author and month of
+   the commits of the log */
+void
+writestats(FILE *fp)
+{
+	writestatstable(fp, &statauthors, "Authors", "authors", "Author",
+	                stats_authorcmp);
+	writestatstable(fp, &statmonths, "Activity", "months", "Month",
+	                stats_monthcmp);
+}
+
+/* add document doc to the postings of term */
+void
+search_addterm(const char *term, size_t doc)
+{
+	struct strtabentry *e;
+	struct postings *pl;
+
+	e = strtab_get(&searchterms, term);
+	if (!e->data && !(e->data = calloc(1, sizeof(struct postings))))
+		err(1, "calloc");
+	pl = e->data;
+	if (pl->ndocs && pl->docs[pl->ndocs - 1] == doc)
+		return;
+	if (pl->ndocs + 1 > pl->cap) {
+		pl->cap = pl->cap ? pl->cap * 2 : 4;
+		if (!(pl->docs = reallocarray(pl->docs, pl->cap, sizeof(*(pl->docs)))))
+			err(1, "realloc");
+	}
+	pl->docs[pl->ndocs++] = doc;
+}
+
+/* split s in terms: lowercase runs of ASCII letters, digits and non-ASCII
+   bytes of at least 2 bytes, cut at 63 bytes without splitting an UTF-8
+   sequence. must match terms() in search.html. */
+void
+search_addtext(const char *s, size_t doc)
+{
+	char term[64];
+	size_t len = 0;
+	unsigned char c;
+	int full = 0;
+
+	for (;; s++) {
+		c = *s;
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+		if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+			if (!full && len < sizeof(term) - 1) {
+				term[len++] = c;
+			} else if (!full) {
+				full = 1;
+				/* the last sequence continues: drop it */
+				if ((c & 0xc0) == 0x80) {
+					while (len > 0 && (term[len - 1] & 0xc0) == 0x80)
+						len--;
+					if (len > 0 && (unsigned char)term[len - 1] >= 0xc0)
+						len--;
+				}
+			}
+			continue;
+		}
+		if (len >= 2) {
+			term[len] = '\0';
+			search_addterm(term, doc);
+		}
+		len = 0;
+		full = 0;
+		if (!c)
+			break;
+	}
+}
+
+/* add the summary, author and changed paths of a newly walked commit */
+void
+search_addcommit(struct commitinfo *ci)
+{
+	struct searchdoc *d;
+	const git_diff_delta *delta;
+	size_t i;
+
+	if (nsearchdocs + 1 > searchdocscap) {
+		searchdocscap = searchdocscap ? searchdocscap * 2 : 1024;
+		if (!(searchdocs = reallocarray(searchdocs, searchdocscap,
+		                                sizeof(*searchdocs))))
+			err(1, "realloc");
+	}
+	d = &searchdocs[nsearchdocs];
+	memset(d, 0, sizeof(*d));
+	memcpy(d->oid, ci->oid, sizeof(d->oid));
+	if (ci->author) {
+		d->when = ci->author->when;
+		if (!(d->author = strdup(ci->author->name)))
+			err(1, "strdup");
+		search_addtext(d->author, nsearchdocs);
+	}
+	if (ci->summary) {
+		if (!(d->summary = strdup(ci->summary)))
+			err(1, "strdup");
+		search_addtext(d->summary, nsearchdocs);
+	}
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = git_diff_get_delta(ci->diff, i);
+		search_addtext(delta->new_file.path, nsearchdocs);
+		if (strcmp(delta->old_file.path, delta->new_file.path))
+			search_addtext(delta->old_file.path, nsearchdocs);
+	}
+	nsearchdocs++;
+}
+
+/* read "search/index.txt" of the previous run: "<documents> <HEAD id>" */
+int
+search_readindex(const git_oid *lastid)
+{
+	FILE *fp;
+	git_oid id;
+	char oidstr[GIT_OID_HEXSZ + 1], *buf;
+	int r = -1;
+
+	if (!(fp = outfopen("search/index.txt", &buf)))
+		return -1;
+	/* the index must be of the last commit of the cache */
+	if (fscanf(fp, "%zu %40s", &searchbase, oidstr) == 2 &&
+	    !git_oid_fromstr(&id, oidstr) && git_oid_equal(&id, lastid))
+		r = 0;
+	outfclose(fp, buf);
+	if (r)
+		searchbase = 0;
+
+	return r;
+}
+
+/* shard file of a term: the first 2 bytes of the term in hex */
+void
+search_shardpath(char *buf, size_t bufsiz, const char *term)
+{
+	snprintf(buf, bufsiz, "search/t%02x%02x.txt",
+	         (unsigned char)term[0], (unsigned char)term[1]);
+}
+
+int
+search_termcmp(const void *v1, const void *v2)
+{
+	return strcmp(*(const char **)v1, *(const char **)v2);
+}
+
+/* write a line of a term shard: "<term> <id> <delta> <delta> ...", the
+   document ids are delta-encoded. ids are the documents of previous runs as
+   read from the shard or NULL, pl the documents of this run or NULL. */
+void
+search_writeterm(FILE *fp, const char *term, const char *ids, struct postings *pl)
+{
+	size_t i, id, last = 0;
+	const char *p;
+	char *end;
+
+	fputs(term, fp);
+	if (ids) {
+		fputc(' ', fp);
+		fputs(ids, fp);
+		for (p = ids; *p; p = end) {
+			last += strtoull(p, &end, 10);
+			if (end == p)
+				break;
+		}
+	}
+	/* documents of this run, oldest first */
+	for (i = pl ? pl->ndocs : 0; i > 0; i--) {
+		id = searchbase + nsearchdocs - 1 - pl->docs[i - 1];
+		fputc(' ', fp);
+		printnum(fp, id - last);
+		last = id;
+	}
+	fputc('\n', fp);
+}
+
+/* is name a term shard "t<hex>.txt" or a document shard "d<n>.txt" */
+int
+search_isshard(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > strlen("t.txt") && (name[0] == 't' || name[0] == 'd') &&
+	       !strcmp(name + len - 4, ".txt");
+}
+
+/* list the shards of previous runs in searchstale */
+void
+search_liststale(void)
+{
+	struct dirent *d;
+	DIR *dp;
+	const char *name;
+	char path[PATH_MAX];
+	size_t i;
+
+	if (archive) {
+		for (i = 0; i < packindex.cap; i++) {
+			if (!(name = packindex.entries[i].key) ||
+			    strncmp(name, "search/", 7) || !search_isshard(name + 7))
+				continue;
+			strtab_get(&searchstale, name);
+		}
+		return;
+	}
+
+	if (!(dp = opendir("search")))
+		return;
+	while ((d = readdir(dp))) {
+		if (!search_isshard(d->d_name))
+			continue;
+		snprintf(path, sizeof(path), "search/%s", d->d_name);
+		strtab_get(&searchstale, path);
+	}
+	closedir(dp);
+}
+
+/* a shard is written by this run */
+void
+search_written(const char *path)
+{
+	struct strtabentry *e;
+
+	if ((e = strtab_find(&searchstale, path)) && e->key)
+		e->data = e;
+}
+
+/* merge the terms of this run into the term shards */
+void
+search_writeterms(int incremental)
+{
+	struct output *o;
+	const char **terms;
+	FILE *fp;
+	char path[PATH_MAX], *line = NULL, *ids, *buf;
+	size_t i, j, n = 0, linesiz = 0;
+	ssize_t linelen;
+
+	if (!(terms = reallocarray(NULL, searchterms.n + 1, sizeof(*terms))))
+		err(1, "realloc");
+	for (i = 0; i < searchterms.cap; i++)
+		if (searchterms.entries[i].key)
+			terms[n++] = searchterms.entries[i].key;
+	qsort(terms, n, sizeof(*terms), search_termcmp);
+
+	for (i = 0; i < n; i = j) {
+		/* terms of the same shard are consecutive */
+		for (j = i + 1; j < n && !memcmp(terms[i], terms[j], 2); j++)
+			;
+		search_shardpath(path, sizeof(path), terms[i]);
+		o = outopen(path);
+		search_written(path);
+
+		/* merge with the sorted terms of the shard */
+		fp = incremental ? outfopen(path, &buf) : NULL;
+		while (fp && (linelen = getline(&line, &linesiz, fp)) > 0) {
+			if (line[linelen - 1] == '\n')
+				line[--linelen] = '\0';
+			if (!(ids = strchr(line, ' ')))
+				continue;
+			*ids++ = '\0';
+			for (; i < j && strcmp(terms[i], line) < 0; i++)
+				search_writeterm(o->fp, terms[i], NULL,
+				                 strtab_find(&searchterms, terms[i])->data);
+			if (i < j && !strcmp(terms[i], line)) {
+				search_writeterm(o->fp, line, ids,
+				                 strtab_find(&searchterms, terms[i])->data);
+				i++;
+			} else {
+				search_writeterm(o->fp, line, ids, NULL);
+			}
+		}
+		if (fp)
+			outfclose(fp, buf);
+		for (; i < j; i++)
+			search_writeterm(o->fp, terms[i], NULL,
+			                 strtab_find(&searchterms, terms[i])->data);
+		outclose(o);
+	}
+	free(line);
+	free(terms);
+}
+
+/* write the documents of this run to the document shards: line n of
+   "search/d<k>.txt" is document k * SEARCHDOCSPERSHARD + n:
+   "<commit id>\t<date>\t<author>\t<summary>" */
+void
+search_writedocs(void)
+{
+	struct output *o = NULL;
+	struct searchdoc *d;
+	FILE *fp;
+	char path[PATH_MAX], buf[BUFSIZ], *data;
+	size_t i, id, n;
+	const char *p;
+
+	for (i = nsearchdocs; i > 0; i--) {
+		id = searchbase + nsearchdocs - i;
+		d = &searchdocs[i - 1];
+		if (!o || id % SEARCHDOCSPERSHARD == 0) {
+			if (o)
+				outclose(o);
+			snprintf(path, sizeof(path), "search/d%zu.txt",
+			         id / SEARCHDOCSPERSHARD);
+			o = outopen(path);
+			search_written(path);
+			/* documents of previous runs in the same shard */
+			if (id % SEARCHDOCSPERSHARD && (fp = outfopen(path, &data))) {
+				while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+					fwrite(buf, 1, n, o->fp);
+				outfclose(fp, data);
+			}
+		}
+		fputs(d->oid, o->fp);
+		fputc('\t', o->fp);
+		if (d->author)
+			printtimeshort(o->fp, &(d->when));
+		fputc('\t', o->fp);
+		for (p = d->author; p && *p; p++)
+			fputc(*p == '\t' || *p == '\n' ? ' ' : *p, o->fp);
+		fputc('\t', o->fp);
+		for (p = d->summary; p && *p; p++)
+			fputc(*p == '\t' || *p == '\n' ? ' ' : *p, o->fp);
+		fputc('\n', o->fp);
+	}
+	if (o)
+		outclose(o);
+}
+
+/* write search.html: a small client-side lookup of the index */
+void
+search_writepage(void)
+{
+	struct output *o;
+
+	o = outopen("search.html");
+	writeheader(o->fp, "Search");
+	fputs("<form onsubmit=\"search(); return false;\">"
+	      "<input type=\"search\" id=\"q\" /> "
+	      "<input type=\"submit\" value=\"Search\" /></form>\n"
+	      "<table id=\"log\"><tbody id=\"results\"></tbody></table>\n"
+	      "<script>\n"
+	      "function get(url) {\n"
+	      "	return fetch(url).then(function(r) { return r.ok ? r.text() : \"\"; });\n"
+	      "}\n"
+	      "function shard(w) {\n"
+	      "	var b = new TextEncoder().encode(w), s = \"\";\n"
+	      "	for (var i = 0; i < 2; i++)\n"
+	      "		s += (b[i] < 16 ? \"0\" : \"\") + b[i].toString(16);\n"
+	      "	return \"search/t\" + s + \".txt\";\n"
+	      "}\n"
+	      "/* documents of the terms that start with w */\n"
+	      "function docs(text, w) {\n"
+	      "	var set = {}, lines = text.split(\"\\n\");\n"
+	      "	for (var i = 0; i < lines.length; i++) {\n"
+	      "		var f = lines[i].split(\" \");\n"
+	      "		if (f[0].substring(0, w.length) !== w)\n"
+	      "			continue;\n"
+	      "		for (var j = 1, id = 0; j < f.length; j++)\n"
+	      "			set[id += Number(f[j])] = 1;\n"
+	      "	}\n"
+	      "	return set;\n"
+	      "}\n"
+	      "/* the terms of the query, as search_addtext() in stagit.c */\n"
+	      "function terms(q) {\n"
+	      "	var b = new TextEncoder().encode(q), words = [], t = [], full = false;\n"
+	      "	for (var i = 0; i <= b.length; i++) {\n"
+	      "		var c = i < b.length ? b[i] : 0;\n"
+	      "		if (c >= 65 && c <= 90)\n"
+	      "			c += 32;\n"
+	      "		if ((c >= 97 && c <= 122) || (c >= 48 && c <= 57) || c >= 128) {\n"
+	      "			if (!full && t.length < 63) {\n"
+	      "				t.push(c);\n"
+	      "			} else if (!full) {\n"
+	      "				full = true;\n"
+	      "				if ((c & 0xc0) === 0x80) {\n"
+	      "					while (t.length && (t[t.length - 1] & 0xc0) === 0x80)\n"
+	      "						t.pop();\n"
+	      "					if (t.length && t[t.length - 1] >= 0xc0)\n"
+	      "						t.pop();\n"
+	      "				}\n"
+	      "			}\n"
+	      "			continue;\n"
+	      "		}\n"
+	      "		if (t.length >= 2)\n"
+	      "			words.push(new TextDecoder().decode(new Uint8Array(t)));\n"
+	      "		t = [];\n"
+	      "		full = false;\n"
+	      "	}\n"
+	      "	return words;\n"
+	      "}\n"
+	      "function esc(s) {\n"
+	      "	return s.replace(/&/g, \"&amp;\").replace(/</g, \"&lt;\").replace(/>/g, \"&gt;\");\n"
+	      "}\n"
+	      "function search() {\n"
+	      "	var words = terms(document.getElementById(\"q\").value);\n"
+	      "	Promise.all(words.map(function(w) {\n"
+	      "		return get(shard(w)).then(function(t) { return docs(t, w); });\n"
+	      "	})).then(function(sets) {\n"
+	      "		var ids = Object.keys(sets[0] || {}).filter(function(id) {\n"
+	      "			return sets.every(function(s) { return s[id]; });\n"
+	      "		}).map(Number).sort(function(a, b) { return b - a; }).slice(0, 100);\n"
+	      "		var shards = {};\n"
+	      "		ids.forEach(function(id) { shards[Math.floor(id / ", o->fp);
+	printnum(o->fp, SEARCHDOCSPERSHARD);
+	fputs(")] = 1; });\n"
+	      "		return Promise.all(Object.keys(shards).map(function(k) {\n"
+	      "			return get(\"search/d\" + k + \".txt\").then(function(t) {\n"
+	      "				shards[k] = t.split(\"\\n\");\n"
+	      "			});\n"
+	      "		})).then(function() {\n"
+	      "			var html = \"\";\n"
+	      "			ids.forEach(function(id) {\n"
+	      "				var f = (shards[Math.floor(id / ", o->fp);
+	printnum(o->fp, SEARCHDOCSPERSHARD);
+	fputs(")][id % ", o->fp);
+	printnum(o->fp, SEARCHDOCSPERSHARD);
+	fputs("] || \"\").split(\"\\t\");\n"
+	      "				if (f.length < 4)\n"
+	      "					return;\n"
+	      "				html += \"<tr><td>\" + esc(f[1]) + \"</td><td><a href=\\\"commit/\" + f[0] +\n"
+	      "					\".html\\\">\" + esc(f[3]) + \"</a></td><td>\" + esc(f[2]) + \"</td></tr>\";\n"
+	      "			});\n"
+	      "			document.getElementById(\"results\").innerHTML = html ||\n"
+	      "				\"<tr><td>No results.</td></tr>\";\n"
+	      "		});\n"
+	      "	});\n"
+	      "}\n"
+	      "</script>\n", o->fp);
+	writefooter(o->fp);
+	outclose(o);
+}
+
+/* write the search index: merges the commits of this run into the index
+   of previous runs when incremental is set, headid is the id of HEAD.
+   otherwise the document ids start at 0 again and the shards of previous
+   runs that are not written are emptied: their ids are of other commits. */
+void
+search_write(int incremental, const char *headid)
+{
+	struct output *o;
+	size_t i;
+
+	outmkdir("search");
+	if (!incremental) {
+		searchbase = 0;
+		search_liststale();
+	}
+	search_writedocs();
+	search_writeterms(incremental);
+	for (i = 0; i < searchstale.cap; i++) {
+		if (!searchstale.entries[i].key || searchstale.entries[i].data)
+			continue;
+		o = outopen(searchstale.entries[i].key);
+		outclose(o);
+	}
+	strtab_free(&searchstale);
+
+	o = outopen("search/index.txt");
+	fprintf(o->fp, "%zu %s\n", searchbase + nsearchdocs, headid);
+	outclose(o);
+
+	search_writepage();
+}
+
+void
+search_free(void)
+{
+	struct postings *pl;
+	size_t i;
+
+	for (i = 0; i < searchterms.cap; i++) {
+		if (!(pl = searchterms.entries[i].data))
+			continue;
+		free(pl->docs);
+		free(pl);
+	}
+	strtab_free(&searchterms);
+	for (i = 0; i < nsearchdocs; i++) {
+		free(searchdocs[i].author);
+		free(searchdocs[i].summary);
+	}
+	free(searchdocs);
+	searchdocs = NULL;
+	nsearchdocs = searchdocscap = 0;
+}
+
+/* open the chain index, a partial last record is ignored */
+void
+chain_open(void)
+{
+	struct stat st;
+
+	if ((chainfd = open(chainfile, O_RDWR | O_CREAT, outmode)) == -1)
+		err(1, "open: '%s'", chainfile);
+	if (fstat(chainfd, &st) == -1)
+		err(1, "fstat: '%s'", chainfile);
+	nchain = st.st_size / GIT_OID_RAWSZ;
+}
+
+/* read n object ids from position pos of the chain */
+void
+chain_read(size_t pos, size_t n, git_oid *ids)
+{
+	size_t i;
+	char *buf;
+
+	if (!(buf = reallocarray(NULL, n, GIT_OID_RAWSZ)))
+		err(1, "reallocarray");
+	if (lseek(chainfd, (off_t)pos * GIT_OID_RAWSZ, SEEK_SET) == -1 ||
+	    readall(chainfd, buf, n * GIT_OID_RAWSZ) != (ssize_t)(n * GIT_OID_RAWSZ))
+		err(1, "read: '%s'", chainfile);
+	for (i = 0; i < n; i++)
+		memcpy(ids[i].id, buf + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ);
+	free(buf);
+}
+
+/* position of a commit on the chain or -1. the last commit is checked
+   first, the ids are read in a hash set on the first other lookup */
+long long
+chain_find(const git_oid *id)
+{
+	struct oidsetentry *e;
+	git_oid *ids, tip;
+	size_t i;
+
+	if (!nchain)
+		return -1;
+	if (!chainpos.n) {
+		chain_read(nchain - 1, 1, &tip);
+		if (git_oid_equal(&tip, id))
+			return nchain - 1;
+
+		if (!(ids = reallocarray(NULL, nchain, sizeof(*ids))))
+			err(1, "reallocarray");
+		chain_read(0, nchain, ids);
+		for (i = 0; i < nchain; i++)
+			oidset_add(&chainpos, &ids[i])->key = i;
+		free(ids);
+	}
+	if (!(e = oidset_get(&chainpos, id)))
+		return -1;
+
+	return e->key;
+}
+
+/* walk the first-parent chain of HEAD back to the last commit of the chain
+   index, only the new commits are walked. when it is not reached the
+   history was rewritten: the chain is kept up to the newest commit that is
+   on it. returns the position of that commit or -1. */
+long long
+chain_update(const git_oid *head)
+{
+	git_revwalk *w = NULL;
+	git_oid id, tip;
+	long long pos = -1;
+	size_t i;
+
+	if (nchain)
+		chain_read(nchain - 1, 1, &tip);
+	git_revwalk_new(&w, repo);
+	git_revwalk_push(w, head);
+	git_revwalk_simplify_first_parent(w);
+	while (!git_revwalk_next(&id, w)) {
+		if (nchain && git_oid_equal(&id, &tip)) {
+			pos = nchain - 1;
+			break;
+		}
+		if (nchainnew == chainnewcap) {
+			chainnewcap = chainnewcap ? chainnewcap * 2 : 64;
+			if (!(chainnew = reallocarray(chainnew, chainnewcap, sizeof(*chainnew))))
+				err(1, "realloc");
+		}
+		git_oid_cpy(&chainnew[nchainnew++], &id);
+	}
+	git_revwalk_free(w);
+
+	if (pos < 0 && nchain) {
+		for (i = 0; i < nchainnew; i++) {
+			if ((pos = chain_find(&chainnew[i])) >= 0) {
+				nchainnew = i;
+				break;
+			}
+		}
+	}
+	chainbase = pos + 1;
+
+	return pos;
+}
+
+/* the commits of HEAD after the commit last, newest first, for the log:
+   the new commits and then the kept commits of the index after its
+   position, which are read at once. when last is NULL or not on the chain
+   of HEAD all commits are used. returns the position of last or -1. */
+long long
+chain_log(const git_oid *last)
+{
+	long long pos = -1;
+	size_t i, n;
+
+	for (i = 0; last && i < nchainnew; i++) {
+		if (git_oid_equal(&chainnew[i], last)) {
+			pos = chainbase + nchainnew - 1 - i;
+			break;
+		}
+	}
+	if (last && pos < 0 && (pos = chain_find(last)) >= (long long)chainbase)
+		pos = -1;
+
+	nchainlog = chainbase + nchainnew - (pos + 1);
+	if (!(chainlog = reallocarray(chainlog, nchainlog ? nchainlog : 1, sizeof(*chainlog))))
+		err(1, "reallocarray");
+	n = nchainlog < nchainnew ? nchainlog : nchainnew;
+	memcpy(chainlog, chainnew, n * sizeof(*chainlog));
+	if (nchainlog > n) {
+		chain_read(pos + 1, nchainlog - n, chainlog + n);
+		/* the index is oldest first */
+		for (i = 0; i < (nchainlog - n) / 2; i++) {
+			git_oid t = chainlog[n + i];
+			chainlog[n + i] = chainlog[nchainlog - 1 - i];
+			chainlog[nchainlog - 1 - i] = t;
+		}
+	}
+
+	return pos;
+}
+
+/* write the new commits after the kept ones */
+void
+chain_write(void)
+{
+	char *buf;
+	size_t i;
+
+	if (!(buf = reallocarray(NULL, nchainnew ? nchainnew : 1, GIT_OID_RAWSZ)))
+		err(1, "reallocarray");
+	for (i = 0; i < nchainnew; i++)
+		memcpy(buf + i * GIT_OID_RAWSZ, chainnew[nchainnew - 1 - i].id,
+		       GIT_OID_RAWSZ);
+	if (lseek(chainfd, (off_t)chainbase * GIT_OID_RAWSZ, SEEK_SET) == -1 ||
+	    writeall(chainfd, buf, nchainnew * GIT_OID_RAWSZ) ||
+	    ftruncate(chainfd, (off_t)(chainbase + nchainnew) * GIT_OID_RAWSZ) == -1 ||
+	    close(chainfd) == -1)
+		err(1, "write: '%s'", chainfile);
+	chainfd = -1;
+	free(buf);
+}
+
+void
+writelogline(FILE *fp, struct commitinfo *ci)
+{
+	fputs("<tr><td>", fp);
+	if (ci->author)
+		printtimeshort(fp, &(ci->author->when));
+	fputs("</td><td>", fp);
+	if (ci->summary) {
+		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
+		xmlencode(fp, ci->summary, strlen(ci->summary));
+		fputs("</a>", fp);
+	}
+	fputs("</td><td>", fp);
+	if (ci->author)
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+	fputs("</td><td class=\"num\" align=\"right\">", fp);
+	printnum(fp, ci->filecount);
+	fputs("</td><td class=\"num\" align=\"right\">+", fp);
+	printnum(fp, ci->addcount);
+	fputs("</td><td class=\"num\" align=\"right\">-", fp);
+	printnum(fp, ci->delcount);
+	fputs("</td></tr>\n", fp);
+}
+
+void
+writeloghead(FILE *fp)
+{
+	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
+	      "<td><b>Commit message</b></td>"
+	      "<td><b>Author</b></td><td class=\"num\" align=\"right\"><b>Files</b></td>"
+	      "<td class=\"num\" align=\"right\"><b>+</b></td>"
+	      "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+}
+
+/* write the page "commit/<oid>.html" of a commit, pages are shared by all
+   logs and written once */
+void
+writecommitpage(struct commitinfo *ci, const char *path)
+{
+	struct oidsetentry *e;
+	struct output *o;
+	const char *rp = relpath;
+	double t, patch;
+
+	t = costtime();
+	patch = cost.patch;
+	relpath = "../";
+	o = outopen(path);
+	writeheader(o->fp, ci->summary);
+	fputs("<pre>", o->fp);
+	printshowfile(o->fp, ci);
+	fputs("</pre>\n", o->fp);
+	writefooter(o->fp);
+	cost.bytes += ftello(o->fp);
+	outclose(o);
+	writediffpages(ci);
+	relpath = rp;
+	/* without generating the patches again */
+	cost.write += costtime() - t - (cost.patch - patch);
+
+	e = oidset_add(&commitpages, ci->id);
+	e->seen = 1;
+	e->key = commitkey;
+}
+
+/* key of the inputs of the commit pages besides the commit itself: the
+   header and the limits of the diffs */
+size_t
+commitpagekey(void)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, key;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		err(1, "open_memstream");
+	relpath = "../";
+	writeheader(fp, "");
+	relpath = "";
+	fprintf(fp, "%d %lld %lld %lld %lld %lld %lld %lld %lld\n",
+	        COMMITVERSION, renames, renamelimit, difffiles, difflines,
+	        diffbytes, commitlines, commitbytes, splitdiff);
+	if (ferror(fp) || fclose(fp))
+		err(1, "fwrite");
+	key = strhash(buf);
+	free(buf);
+
+	return key;
+}
+
+/* read the keys of the existing commit pages: "oid key" lines */
+void
+commitmanifest_read(void)
+{
+	struct oidsetentry *e;
+	FILE *fp;
+	git_oid id;
+	char *buf, line[128], *p;
+	size_t key;
+
+	if (!(fp = outfopen("commit/index.txt", &buf)))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strlen(line) < GIT_OID_HEXSZ + 2 || line[GIT_OID_HEXSZ] != ' ' ||
+		    git_oid_fromstrn(&id, line, GIT_OID_HEXSZ))
+			continue;
+		key = strtoull(line + GIT_OID_HEXSZ + 1, &p, 16);
+		if (*p != '\n')
+			continue;
+		/* only of pages that exist */
+		if ((e = oidset_get(&commitpages, &id)))
+			e->key = key;
+	}
+	outfclose(fp, buf);
+}
+
+int
+oidsetentry_cmp(const void *v1, const void *v2)
+{
+	return git_oid_cmp(&((*(struct oidsetentry **)v1)->id),
+	                   &((*(struct oidsetentry **)v2)->id));
+}
+
+/* sorted by oid: the manifest does not change with the slot order */
+void
+commitmanifest_write(void)
+{
+	struct oidsetentry **entries;
+	struct output *o;
+	char oidstr[GIT_OID_HEXSZ + 1];
+	size_t i, n = 0;
+
+	if (!(entries = reallocarray(NULL, commitpages.n + 1, sizeof(*entries))))
+		err(1, "reallocarray");
+	for (i = 0; i < commitpages.cap; i++)
+		if (commitpages.entries[i].used)
+			entries[n++] = &(commitpages.entries[i]);
+	qsort(entries, n, sizeof(*entries), oidsetentry_cmp);
+
+	o = outopen("commit/index.txt");
+	for (i = 0; i < n; i++) {
+		git_oid_tostr(oidstr, sizeof(oidstr), &(entries[i]->id));
+		fprintf(o->fp, "%s %zx\n", oidstr, entries[i]->key);
+	}
+	outclose(o);
+	free(entries);
+}
+
+/* write the page of a commit again */
+int
+rewritecommitpage(const git_oid *id, struct arena *a)
+{
+	struct commitinfo *ci;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
+	int r;
+
+	git_oid_tostr(oidstr, sizeof(oidstr), id);
+	r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'commit/%s.html'", oidstr);
+	if (!(ci = commitinfo_getbyoid(id, a)))
+		return -1;
+	if ((r = commitinfo_getstats(ci)) != -1)
+		writecommitpage(ci, path);
+	commitinfo_free(ci);
+
+	return r;
+}
+
+/* write the commit pages of which the inputs changed since they were
+   written, see commitpagekey(). orphaned pages are left alone. the pages
+   are rendered by jobs child processes, which share no libgit2 objects or
+   caches, and are written by the parent. only the commits of which the
+   page was written get the current key, the others are tried again. */
+void
+writestalecommits(void)
+{
+	struct arena arena = { 0 };
+	struct oidsetentry *e;
+	struct pollfd *pfds;
+	git_oid *ids, id;
+	pid_t *pids;
+	char oidstr[GIT_OID_HEXSZ + 1];
+	size_t n = 0, ndone = 0, i;
+	long nproc, p, open;
+	int fds[2], status, failed = 0;
+
+	for (i = 0; i < commitpages.cap; i++)
+		if (commitpages.entries[i].used && commitpages.entries[i].key != commitkey &&
+		    (commitpages.entries[i].seen || !walkedall))
+			n++;
+	if (!n)
+		return;
+	if (!(ids = reallocarray(NULL, n, sizeof(*ids))))
+		err(1, "reallocarray");
+	for (i = n = 0; i < commitpages.cap; i++)
+		if (commitpages.entries[i].used && commitpages.entries[i].key != commitkey &&
+		    (commitpages.entries[i].seen || !walkedall))
+			git_oid_cpy(&ids[n++], &(commitpages.entries[i].id));
+	if (verbose)
+		fprintf(stderr, "%zu commit pages are written again\n", n);
+
+	if ((nproc = nthreads()) > (long)n)
+		nproc = n;
+	if (nproc == 1) {
+		for (i = 0; i < n; i++) {
+			if (rewritecommitpage(&ids[i], &arena) == -1)
+				continue;
+			oidset_get(&commitpages, &ids[i])->key = commitkey;
+			ndone++;
+		}
+		goto done;
+	}
+
+	if (!(pfds = reallocarray(NULL, nproc, sizeof(*pfds))) ||
+	    !(pids = reallocarray(NULL, nproc, sizeof(*pids))))
+		err(1, "reallocarray");
+	fflush(stdout);
+	fflush(stderr);
+	for (p = 0; p < nproc; p++) {
+		if (pipe(fds) == -1)
+			err(1, "pipe");
+		switch ((pids[p] = fork())) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			/* child: every nproc-th page */
+			for (i = 0; i < (size_t)p; i++)
+				close(pfds[i].fd);
+			close(fds[0]);
+			outpipe = fds[1];
+			for (i = p; i < n; i += nproc) {
+				if (rewritecommitpage(&ids[i], &arena) == -1)
+					continue;
+				git_oid_tostr(oidstr, sizeof(oidstr), &ids[i]);
+				outsend(oidstr, NULL, 0);
+			}
+			_exit(0);
+		}
+		close(fds[1]);
+		pfds[p].fd = fds[0];
+		pfds[p].events = POLLIN;
+	}
+
+	/* pages of the children in the order they are ready */
+	for (open = nproc; open > 0; ) {
+		if (poll(pfds, nproc, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (p = 0; p < nproc; p++) {
+			if (pfds[p].fd == -1 || !pfds[p].revents)
+				continue;
+			switch (outrecv(pfds[p].fd, oidstr, sizeof(oidstr))) {
+			case 0:
+				close(pfds[p].fd);
+				pfds[p].fd = -1;
+				open--;
+				break;
+			case 2:
+				/* the page of the commit is written */
+				if (git_oid_fromstr(&id, oidstr) ||
+				    !(e = oidset_get(&commitpages, &id)))
+					errx(1, "read: invalid commit of a child process");
+				e->key = commitkey;
+				ndone++;
+				break;
+			}
+		}
+	}
+	for (p = 0; p < nproc; p++) {
+		if (waitpid(pids[p], &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	if (failed)
+		errx(1, "a child process writing commit pages failed");
+	free(pids);
+	free(pfds);
+
+done:
+	if (ndone < n)
+		warnx("%zu commit pages could not be written again", n - ndone);
+	arena_free(&arena);
+	free(ids);
+}
+
+int
+writelog(FILE *fp, const git_oid *oid)
+{
+	struct arena arena = { 0 };
+	struct commitinfo *ci;
+	struct oidsetentry *e;
+	git_revwalk *w = NULL;
+	git_oid id;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
+	size_t i;
+	int r, all = 1;
+
+	/* with the cache the commits are taken from the chain index, they
+	   end before the last commit of the cache */
+	if (chainlog) {
+		if (nchainlog < chainbase + nchainnew)
+			all = 0;
+	} else {
+		git_revwalk_new(&w, repo);
+		git_revwalk_push(w, oid);
+		git_revwalk_simplify_first_parent(w);
+	}
+
+	for (i = 0; chainlog ? i < nchainlog : !git_revwalk_next(&id, w); i++) {
+		relpath = "";
+		if (chainlog)
+			git_oid_cpy(&id, &chainlog[i]);
+
+		git_oid_tostr(oidstr, sizeof(oidstr), &id);
+		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s.html'", oidstr);
+		if ((e = oidset_get(&commitpages, &id))) {
+			e->seen = 1;
+			r = 0;
+		} else {
+			r = -1;
+		}
+
+		/* optimization: if there are no log lines to write and
+		   the commit file already exists: skip the diffstat */
+		if (!nlogcommits && !r && !filehistory && !searchindex &&
+		    !statspage)
+			continue;
+
+		if (!(ci = commitinfo_getbyoid(&id, &arena))) {
+			all = 0;
+			break;
+		}
+		cost_begin(oidstr);
+		/* diffstat: for stagit HTML required for the log.html line */
+		if (commitinfo_getstats(ci) == -1)
+			goto err;
+		if (filehistory)
+			filehistory_addcommit(ci);
+		if (searchindex)
+			search_addcommit(ci);
+		if (statspage)
+			stats_addcommit(ci);
+
+		if (nlogcommits < 0) {
+			writelogline(fp, ci);
+		} else if (nlogcommits > 0) {
+			writelogline(fp, ci);
+			nlogcommits--;
+			if (!nlogcommits && ci->parentoid[0])
+				fputs("<tr><td></td><td colspan=\"5\">"
+				      "More commits remaining [...]</td>"
+				      "</tr>\n", fp);
+		}
+
+		if (cachefile)
+			writelogline(wcachefp, ci);
+
+		/* check if file exists if so skip it */
+		if (r && deferpages)
+			oidset_add(&commitpages, ci->id)->seen = 1;
+		else if (r)
+			writecommitpage(ci, path);
+err:
+		commitinfo_free(ci);
+		cost_end();
+	}
+	git_revwalk_free(w);
+	arena_free(&arena);
+	if (!all)
+		walkedall = 0;
+
+	relpath = "";
+
+	return 0;
+}
+
+/* is there a log of the branch, see -b */
+int
+isbranchlog(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nbranchglobs; i++)
+		if (!fnmatch(branchglobs[i], name, 0))
+			return 1;
+
+	return 0;
+}
+
+/* write the log "log/<branch>.html" of a branch. With a cache file it is
+   updated from the tip of the last run, stored in "<cachefile>.branches/". */
+int
+writebranchlog(const char *branch, const git_oid *tip, long long limit)
+{
+	struct arena arena = { 0 };
+	struct commitinfo *ci;
+	struct output *o;
+	struct oidsetentry *e;
+	git_revwalk *w = NULL;
+	git_oid id, lastid;
+	FILE *rfp = NULL, *wfp = NULL;
+	const char *p;
+	char path[PATH_MAX], logpath[PATH_MAX], cachepath[PATH_MAX];
+	char rel[PATH_MAX], tmppath[64] = "cache.XXXXXXXXXXXX";
+	char oidstr[GIT_OID_HEXSZ + 1], buf[BUFSIZ], *d;
+	size_t n;
+	int fd, r, found = 0;
+
+	r = snprintf(logpath, sizeof(logpath), "log/%s.html", branch);
+	if (r < 0 || (size_t)r >= sizeof(logpath))
+		errx(1, "path truncated: 'log/%s.html'", branch);
+	if (strlcpy(rel, logpath, sizeof(rel)) >= sizeof(rel))
+		errx(1, "path truncated: '%s'", logpath);
+	if (!(d = dirname(rel)))
+		err(1, "dirname");
+	if (outmkdir(d))
+		err(1, "mkdir: '%s'", d);
+	for (p = logpath, rel[0] = '\0'; *p; p++)
+		if (*p == '/' && strlcat(rel, "../", sizeof(rel)) >= sizeof(rel))
+			errx(1, "path truncated: '../%s'", rel);
+
+	if (cachefile) {
+		r = snprintf(cachepath, sizeof(cachepath), "%s.branches/%s",
+		             cachefile, branch);
+		if (r < 0 || (size_t)r >= sizeof(cachepath))
+			errx(1, "path truncated: '%s.branches/%s'", cachefile, branch);
+		/* read from cache file (does not need to exist) */
+		if ((rfp = fopen(cachepath, "r"))) {
+			if (!fgets(oidstr, sizeof(oidstr), rfp) ||
+			    git_oid_fromstr(&lastid, oidstr)) {
+				fclose(rfp);
+				rfp = NULL;
+			} else {
+				/* skip the newline */
+				fgetc(rfp);
+			}
+		}
+		if ((fd = mkstemp(tmppath)) == -1)
+			err(1, "mkstemp");
+		if (!(wfp = fdopen(fd, "w")))
+			err(1, "fdopen: '%s'", tmppath);
+		git_oid_tostr(oidstr, sizeof(oidstr), tip);
+		fprintf(wfp, "%s\n", oidstr);
+	}
+
+	o = outopen(logpath);
+	relpath = rel;
+	writeheader(o->fp, branch);
+	writeloghead(o->fp);
+
+	git_revwalk_new(&w, repo);
+	git_revwalk_push(w, tip);
+	git_revwalk_simplify_first_parent(w);
+
+	while (!git_revwalk_next(&id, w)) {
+		if (rfp && git_oid_equal(&id, &lastid)) {
+			found = 1;
+			break;
+		}
+
+		git_oid_tostr(oidstr, sizeof(oidstr), &id);
+		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s.html'", oidstr);
+		/* the page is shared with the other logs */
+		if ((e = oidset_get(&commitpages, &id)))
+			e->seen = 1;
+		if (!limit && e)
+			continue;
+
+		if (!(ci = commitinfo_getbyoid(&id, &arena))) {
+			walkedall = 0;
+			break;
+		}
+		cost_begin(oidstr);
+		if (commitinfo_getstats(ci) == -1)
+			goto err;
+
+		relpath = rel;
+		if (limit) {
+			writelogline(o->fp, ci);
+			if (limit > 0 && !--limit && ci->parentoid[0])
+				fputs("<tr><td></td><td colspan=\"5\">"
+				      "More commits remaining [...]</td>"
+				      "</tr>\n", o->fp);
+		}
+		if (wfp)
+			writelogline(wfp, ci);
+
+		if (!e && deferpages)
+			oidset_add(&commitpages, ci->id)->seen = 1;
+		else if (!e)
+			writecommitpage(ci, path);
+err:
+		commitinfo_free(ci);
+		cost_end();
+	}
+	git_revwalk_free(w);
+	arena_free(&arena);
+
+	if (found) {
+		/* append previous log to the log and the new cache */
+		walkedall = 0;
+		while (!feof(rfp)) {
+			n = fread(buf, 1, sizeof(buf), rfp);
+			if (ferror(rfp))
+				err(1, "fread");
+			if (fwrite(buf, 1, n, o->fp) != n ||
+			    fwrite(buf, 1, n, wfp) != n)
+				err(1, "fwrite");
+		}
+	}
+	if (rfp)
+		fclose(rfp);
+
+	fputs("</tbody></table>", o->fp);
+	writefooter(o->fp);
+	outclose(o);
+	relpath = "";
+
+	/* rename new cache file on success, after the pages are written */
+	if (wfp) {
+		outflush();
+		if (fclose(wfp))
+			err(1, "fclose: '%s'", tmppath);
+		if (strlcpy(path, cachepath, sizeof(path)) >= sizeof(path))
+			errx(1, "path truncated: '%s'", cachepath);
+		if (!(d = dirname(path)))
+			err(1, "dirname");
+		if (mkdirp(d))
+			err(1, "mkdir: '%s'", d);
+		if (rename(tmppath, cachepath))
+			err(1, "rename: '%s' to '%s'", tmppath, cachepath);
+		if (chmod(cachepath, outmode))
+			err(1, "chmod: '%s'", cachepath);
+	}
+
+	return 0;
+}
+
+/* write the logs of the branches matching a pattern of -b */
+void
+writebranchlogs(long long limit)
+{
+	git_reference_iterator *it = NULL;
+	git_reference *ref = NULL;
+	git_object *obj = NULL;
+	const char *s;
+
+	if (git_reference_iterator_new(&it, repo))
+		return;
+	while (!git_reference_next(&ref, it)) {
+		s = git_reference_shorthand(ref);
+		if (git_reference_is_branch(ref) && isbranchlog(s) &&
+		    !git_reference_peel(&obj, ref, GIT_OBJ_COMMIT)) {
+			writebranchlog(s, git_object_id(obj), limit);
+			git_object_free(obj);
+			obj = NULL;
+		}
+		git_reference_free(ref);
+		ref = NULL;
+	}
+	git_reference_iterator_free(it);
+}
+
+/* pages of commits that are not in the history anymore (for example
+   after a forced push) are only known after a walk of all commits. */
+void
+writeorphans(void)
+{
+	char oidstr[GIT_OID_HEXSZ + 1];
+	size_t i;
+
+	if (!walkedall)
+		return;
+	for (i = 0; i < commitpages.cap; i++) {
+		if (!commitpages.entries[i].used || commitpages.entries[i].seen)
+			continue;
+		git_oid_tostr(oidstr, sizeof(oidstr), &(commitpages.entries[i].id));
+		fprintf(stderr, "orphaned page: commit/%s.html\n", oidstr);
+	}
+}
+
+void
+printcommitatom(FILE *fp, struct commitinfo *ci, const char *tag)
+{
+	fputs("<entry>\n", fp);
+
+	fprintf(fp, "<id>%s</id>\n", ci->oid);
+	if (ci->author) {
+		fputs("<published>", fp);
+		printtimez(fp, &(ci->author->when));
+		fputs("</published>\n", fp);
+	}
+	if (ci->committer) {
+		fputs("<updated>", fp);
+		printtimez(fp, &(ci->committer->when));
+		fputs("</updated>\n", fp);
+	}
+	if (ci->summary) {
+		fputs("<title type=\"text\">", fp);
+		if (tag && tag[0]) {
+			fputs("[", fp);
+			xmlencode(fp, tag, strlen(tag));
+			fputs("] ", fp);
+		}
+		xmlencode(fp, ci->summary, strlen(ci->summary));
+		fputs("</title>\n", fp);
+	}
+	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"commit/%s.html\" />\n",
+	        ci->oid);
+
+	if (ci->author) {
+		fputs("<author>\n<name>", fp);
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+		fputs("</name>\n<email>", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("</email>\n</author>\n", fp);
+	}
+
+	fputs("<content type=\"text\">", fp);
+	fprintf(fp, "commit %s\n", ci->oid);
+	if (ci->parentoid[0])
+		fprintf(fp, "parent %s\n", ci->parentoid);
+	if (ci->author) {
+		fputs("Author: ", fp);
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+		fputs(" &lt;", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("&gt;\nDate:   ", fp);
+		printtime(fp, &(ci->author->when));
+		fputc('\n', fp);
+	}
+	if (ci->msg) {
+		fputc('\n', fp);
+		xmlencode(fp, ci->msg, strlen(ci->msg));
+	}
+	fputs("\n</content>\n</entry>\n", fp);
+}
+
+int
+writeatom(FILE *fp, int all)
+{
+	struct referenceinfo *ris = NULL;
+	size_t refcount = 0;
+	struct commitinfo *ci;
+	git_revwalk *w = NULL;
+	git_oid id;
+	size_t i, m = 100; /* last 'm' commits */
+
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
+	xmlencode(fp, strippedname, strlen(strippedname));
+	fputs(", branch HEAD</title>\n<subtitle>", fp);
+	xmlencode(fp, description, strlen(description));
+	fputs("</subtitle>\n", fp);
+
+	/* all commits or only tags? */
+	if (all) {
+		git_revwalk_new(&w, repo);
+		git_revwalk_push_head(w);
+		git_revwalk_simplify_first_parent(w);
+		for (i = 0; i < m && !git_revwalk_next(&id, w); i++) {
+			if (!(ci = commitinfo_getbyoid(&id, NULL)))
+				break;
+			printcommitatom(fp, ci, "");
+			commitinfo_free(ci);
+		}
+		git_revwalk_free(w);
+	} else if (getrefs(&ris, &refcount) != -1) {
+		/* references: tags */
+		for (i = 0; i < refcount; i++) {
+			if (git_reference_is_tag(ris[i].ref))
+				printcommitatom(fp, ris[i].ci,
+				                git_reference_shorthand(ris[i].ref));
+
+			commitinfo_free(ris[i].ci);
+			git_reference_free(ris[i].ref);
+		}
+		free(ris);
+	}
+
+	fputs("</feed>\n", fp);
+
+	return 0;
+}
+
+int
+writeblob(git_object *obj, const char *fpath, const char *filename,
+          const char *entrypath, git_off_t filesize)
+{
+	struct output *o;
+	struct cost c;
+	char tmp[PATH_MAX] = "", *d;
+	const char *p;
+	int lc = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.start = costtime();
+	if (strlcpy(tmp, fpath, sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '%s'", fpath);
+	if (!(d = dirname(tmp)))
+		err(1, "dirname");
+	if (outmkdir(d))
+		return -1;
+
+	for (p = fpath, tmp[0] = '\0'; *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	relpath = tmp;
+
+	o = outopen(fpath);
+	writeheader(o->fp, filename);
+	fputs("<p> ", o->fp);
+	xmlencode(o->fp, filename, strlen(filename));
+	fprintf(o->fp, " (%juB)", (uintmax_t)filesize);
+	if (filehistory) {
+		fprintf(o->fp, " <a href=\"%shistory/", relpath);
+		xmlencode(o->fp, entrypath, strlen(entrypath));
+		fputs(".html\">History</a>", o->fp);
+	}
+	if (blamepages) {
+		fprintf(o->fp, " <a href=\"%sblame/", relpath);
+		xmlencode(o->fp, entrypath, strlen(entrypath));
+		fputs(".html\">Blame</a>", o->fp);
+	}
+	fputs("</p><hr/>", o->fp);
+
+	if (git_blob_is_binary((git_blob *)obj)) {
+		fputs("<p>Binary file.</p>\n", o->fp);
+	} else {
+		lc = writeblobhtml(o->fp, (git_blob *)obj);
+		if (ferror(o->fp))
+			err(1, "fwrite");
+	}
+	writefooter(o->fp);
+	c.bytes = ftello(o->fp);
+	outclose(o);
+
+	relpath = "";
+
+	if (reportfile) {
+		c.name = (char *)entrypath;
+		c.total = c.write = costtime() - c.start;
+		c.lines = lc;
+		cost_add(&topblobs, &ntopblobs, &c);
+	}
+
+	return lc;
+}
+
+/* write the last commit that changed path as a column in files.html */
+void
+writelastcommit(FILE *fp, const char *path)
+{
+	git_commit *commit;
+	const git_signature *author;
+	const git_oid *id;
+	const char *summary;
+	char oidstr[GIT_OID_HEXSZ + 1];
+
+	fputs("</td><td>", fp);
+	if (!(id = filehistory_last(path)) ||
+	    git_commit_lookup(&commit, repo, id))
+		return;
+	author = git_commit_author(commit);
+	summary = git_commit_summary(commit);
+	if (author) {
+		printtimeshort(fp, &(author->when));
+		fputc(' ', fp);
+	}
+	if (summary) {
+		git_oid_tostr(oidstr, sizeof(oidstr), id);
+		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, oidstr);
+		xmlencode(fp, summary, strlen(summary));
+		fputs("</a>", fp);
+	}
+	git_commit_free(commit);
+}
+
+const char *
+filemode(git_filemode_t m)
+{
+	static char mode[11];
+
+	memset(mode, '-', sizeof(mode) - 1);
+	mode[10] = '\0';
+
+	if (S_ISREG(m))
+		mode[0] = '-';
+	else if (S_ISBLK(m))
+		mode[0] = 'b';
+	else if (S_ISCHR(m))
+		mode[0] = 'c';
+	else if (S_ISDIR(m))
 		mode[0] = 'd';
 	else if (S_ISFIFO(m))
 		mode[0] = 'p';
@@ -965,99 +4653,1510 @@ filemode(git_filemode_t m)
 	if (m & S_ISGID) mode[6] = (mode[6] == 'x') ? 's' : 'S';
 	if (m & S_ISVTX) mode[9] = (mode[9] == 'x') ? 't' : 'T';
 
-	return mode;
+	return mode;
+}
+
+int
+writefilestree(FILE *fp, git_tree *tree, const char *path)
+{
+	const git_tree_entry *entry = NULL;
+	git_object *obj = NULL;
+	git_off_t filesize;
+	const char *entryname;
+	char filepath[PATH_MAX], entrypath[PATH_MAX];
+	size_t count, i;
+	int lc, r, ret;
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(tree, i)) ||
+		    !(entryname = git_tree_entry_name(entry)))
+			return -1;
+		joinpath(entrypath, sizeof(entrypath), path, entryname);
+
+		r = snprintf(filepath, sizeof(filepath), "file/%s.html",
+		         entrypath);
+		if (r < 0 || (size_t)r >= sizeof(filepath))
+			errx(1, "path truncated: 'file/%s.html'", entrypath);
+
+		if (!git_tree_entry_to_object(&obj, repo, entry)) {
+			switch (git_object_type(obj)) {
+			case GIT_OBJ_BLOB:
+				break;
+			case GIT_OBJ_TREE:
+				/* NOTE: recurses */
+				ret = writefilestree(fp, (git_tree *)obj,
+				                     entrypath);
+				git_object_free(obj);
+				if (ret)
+					return ret;
+				continue;
+			default:
+				git_object_free(obj);
+				continue;
+			}
+
+			filesize = git_blob_rawsize((git_blob *)obj);
+			lc = writeblob(obj, filepath, entryname, entrypath, filesize);
+
+			fputs("<tr><td>", fp);
+			fputs(filemode(git_tree_entry_filemode(entry)), fp);
+			fprintf(fp, "</td><td><a href=\"%s", relpath);
+			xmlencode(fp, filepath, strlen(filepath));
+			fputs("\">", fp);
+			xmlencode(fp, entrypath, strlen(entrypath));
+			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
+			if (lc > 0)
+				fprintf(fp, "%dL", lc);
+			else
+				fprintf(fp, "%juB", (uintmax_t)filesize);
+			if (filehistory)
+				writelastcommit(fp, entrypath);
+			fputs("</td></tr>\n", fp);
+			git_object_free(obj);
+		} else if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT) {
+			/* commit object in tree is a submodule */
+			fprintf(fp, "<tr><td>m---------</td><td><a href=\"%sfile/.gitmodules.html\">",
+				relpath);
+			xmlencode(fp, entrypath, strlen(entrypath));
+			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
+			if (filehistory)
+				fputs("</td><td>", fp);
+			fputs("</td></tr>\n", fp);
+		}
+	}
+
+	return 0;
+}
+
+/* key of the settings that are rendered in the pages besides the objects
+   themselves: the header and the tunables of the blob pages */
+size_t
+settingskey(void)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, key;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		err(1, "open_memstream");
+	relpath = "";
+	writeheader(fp, "");
+	fprintf(fp, "%d %lld %lld %d %d\n", PAGEVERSION, maxblobbytes,
+	        maxbloblines, filehistory, blamepages);
+	if (ferror(fp) || fclose(fp))
+		err(1, "fwrite");
+	key = strhash(buf);
+	free(buf);
+
+	return key;
+}
+
+/* read the pages of the last run "tree/index.txt", ignored when the
+   settings changed */
+void
+pageindex_read(size_t key)
+{
+	struct strtabentry *e;
+	struct pageinfo *pi;
+	FILE *fp;
+	char *line = NULL, *p, *path, *buf;
+	size_t linesiz = 0, oldkey;
+	ssize_t linelen;
+	long long size;
+	int lc;
+
+	if (!(fp = outfopen("tree/index.txt", &buf)))
+		return;
+	if (fscanf(fp, "%zx\n", &oldkey) != 1 || oldkey != key) {
+		outfclose(fp, buf);
+		return;
+	}
+	/* lines: "oid lines size path" */
+	while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen < GIT_OID_HEXSZ + 3 || line[GIT_OID_HEXSZ] != ' ')
+			continue;
+		lc = strtol(line + GIT_OID_HEXSZ + 1, &p, 10);
+		if (*p != ' ')
+			continue;
+		size = strtoll(p + 1, &p, 10);
+		if (*p != ' ')
+			continue;
+		path = p + 1;
+		e = strtab_get(&pageindex, path);
+		if (!(pi = e->data) && !(pi = e->data = calloc(1, sizeof(*pi))))
+			err(1, "calloc");
+		if (git_oid_fromstrn(&(pi->id), line, GIT_OID_HEXSZ))
+			memset(&(pi->id), 0, sizeof(pi->id));
+		pi->lc = lc;
+		pi->size = size;
+	}
+	free(line);
+	outfclose(fp, buf);
+}
+
+/* is the page "tree/<path>.html" or "file/<path>.html" of a directory or a
+   file of the tree */
+int
+pageindex_intree(git_tree *tree, const char *page)
+{
+	git_tree_entry *entry = NULL;
+	git_otype type;
+	char path[PATH_MAX];
+	size_t len;
+	int r;
+
+	if (!strncmp(page, "tree/", strlen("tree/")))
+		type = GIT_OBJ_TREE;
+	else if (!strncmp(page, "file/", strlen("file/")))
+		type = GIT_OBJ_BLOB;
+	else
+		return 0;
+	len = strlen(page) - strlen("tree/");
+	if (len <= strlen(".html") || len - strlen(".html") >= sizeof(path))
+		return 0;
+	memcpy(path, page + strlen("tree/"), len - strlen(".html"));
+	path[len - strlen(".html")] = '\0';
+
+	if (git_tree_entry_bypath(&entry, tree, path))
+		return 0;
+	r = git_tree_entry_type(entry) == type;
+	git_tree_entry_free(entry);
+
+	return r;
+}
+
+/* write the index of the pages of the paths of the tree, the pages of the
+   paths that are not in it anymore are removed */
+void
+pageindex_write(size_t key, git_tree *tree)
+{
+	struct output *o;
+	struct pageinfo *pi;
+	char oidstr[GIT_OID_HEXSZ + 1];
+	size_t i;
+
+	o = outopen("tree/index.txt");
+	fprintf(o->fp, "%zx\n", key);
+	for (i = 0; i < pageindex.cap; i++) {
+		if (!pageindex.entries[i].key)
+			continue;
+		if (!pageindex_intree(tree, pageindex.entries[i].key)) {
+			outremove(pageindex.entries[i].key);
+			continue;
+		}
+		pi = pageindex.entries[i].data;
+		git_oid_tostr(oidstr, sizeof(oidstr), &(pi->id));
+		fprintf(o->fp, "%s %d %jd %s\n", oidstr, pi->lc,
+		        (intmax_t)pi->size, pageindex.entries[i].key);
+	}
+	outclose(o);
+}
+
+void
+pageindex_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < pageindex.cap; i++)
+		free(pageindex.entries[i].data);
+	strtab_free(&pageindex);
+}
+
+/* the page was rendered from the object id before and still exists */
+struct pageinfo *
+pageindex_unchanged(const char *path, const git_oid *id)
+{
+	struct strtabentry *e;
+	struct pageinfo *pi;
+
+	if (!(e = strtab_find(&pageindex, path)) || !e->key)
+		return NULL;
+	pi = e->data;
+	if (!git_oid_equal(&(pi->id), id) || !outexists(path))
+		return NULL;
+
+	return pi;
+}
+
+void
+pageindex_set(const char *path, const git_oid *id, int lc, git_off_t size)
+{
+	struct strtabentry *e;
+	struct pageinfo *pi;
+
+	e = strtab_get(&pageindex, path);
+	if (!(pi = e->data) && !(pi = e->data = calloc(1, sizeof(*pi))))
+		err(1, "calloc");
+	pi->id = *id;
+	pi->lc = lc;
+	pi->size = size;
+}
+
+void
+writetreehead(FILE *fp)
+{
+	fputs("<table id=\"files\"><thead>\n<tr>"
+	      "<td><b>Mode</b></td><td><b>Name</b></td>"
+	      "<td class=\"num\" align=\"right\"><b>Size</b></td>", fp);
+	if (filehistory)
+		fputs("<td><b>Last commit</b></td>", fp);
+	fputs("</tr>\n</thead><tbody>\n", fp);
+}
+
+/* write the direct entries of a tree as rows, rel is the relative path of
+   the page to the root */
+int
+writetreeentries(FILE *fp, git_tree *tree, const char *path, const char *rel)
+{
+	const git_tree_entry *entry = NULL;
+	git_object *obj = NULL;
+	struct pageinfo *pi;
+	git_off_t filesize;
+	const char *entryname;
+	char filepath[PATH_MAX], entrypath[PATH_MAX];
+	size_t count, i;
+	int lc, r;
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(tree, i)) ||
+		    !(entryname = git_tree_entry_name(entry)))
+			return -1;
+		joinpath(entrypath, sizeof(entrypath), path, entryname);
+
+		switch (git_tree_entry_type(entry)) {
+		case GIT_OBJ_TREE:
+			r = snprintf(filepath, sizeof(filepath), "tree/%s.html",
+			             entrypath);
+			if (r < 0 || (size_t)r >= sizeof(filepath))
+				errx(1, "path truncated: 'tree/%s.html'", entrypath);
+			fputs("<tr><td>", fp);
+			fputs(filemode(git_tree_entry_filemode(entry)), fp);
+			fprintf(fp, "</td><td><a href=\"%s", rel);
+			xmlencode(fp, filepath, strlen(filepath));
+			fputs("\">", fp);
+			xmlencode(fp, entryname, strlen(entryname));
+			fputs("/</a></td><td class=\"num\" align=\"right\">", fp);
+			if (filehistory)
+				fputs("</td><td>", fp);
+			fputs("</td></tr>\n", fp);
+			break;
+		case GIT_OBJ_BLOB:
+			r = snprintf(filepath, sizeof(filepath), "file/%s.html",
+			             entrypath);
+			if (r < 0 || (size_t)r >= sizeof(filepath))
+				errx(1, "path truncated: 'file/%s.html'", entrypath);
+
+			/* the blob page of an unchanged file is kept */
+			if (!(pi = pageindex_unchanged(filepath, git_tree_entry_id(entry)))) {
+				if (git_tree_entry_to_object(&obj, repo, entry))
+					continue;
+				filesize = git_blob_rawsize((git_blob *)obj);
+				lc = writeblob(obj, filepath, entryname, entrypath, filesize);
+				git_object_free(obj);
+				pageindex_set(filepath, git_tree_entry_id(entry), lc, filesize);
+			} else {
+				lc = pi->lc;
+				filesize = pi->size;
+			}
+
+			fputs("<tr><td>", fp);
+			fputs(filemode(git_tree_entry_filemode(entry)), fp);
+			fprintf(fp, "</td><td><a href=\"%s", rel);
+			xmlencode(fp, filepath, strlen(filepath));
+			fputs("\">", fp);
+			xmlencode(fp, entryname, strlen(entryname));
+			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
+			if (lc > 0)
+				fprintf(fp, "%dL", lc);
+			else
+				fprintf(fp, "%juB", (uintmax_t)filesize);
+			if (filehistory)
+				writelastcommit(fp, entrypath);
+			fputs("</td></tr>\n", fp);
+			break;
+		case GIT_OBJ_COMMIT:
+			/* commit object in tree is a submodule */
+			fprintf(fp, "<tr><td>m---------</td><td><a href=\"%sfile/.gitmodules.html\">",
+				rel);
+			xmlencode(fp, entryname, strlen(entryname));
+			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
+			if (filehistory)
+				fputs("</td><td>", fp);
+			fputs("</td></tr>\n", fp);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
 }
 
+/* write the pages "tree/<path>.html" of the subtrees of tree, recursively.
+   Subtrees that are unchanged since the last run are skipped as a whole. */
 int
-writefilestree(FILE *fp, git_tree *tree, const char *path)
+writetreepages(git_tree *tree, const char *path)
 {
 	const git_tree_entry *entry = NULL;
 	git_object *obj = NULL;
-	git_off_t filesize;
-	const char *entryname;
-	char filepath[PATH_MAX], entrypath[PATH_MAX];
+	struct output *o;
+	const char *entryname, *p;
+	char pagepath[PATH_MAX], entrypath[PATH_MAX], rel[PATH_MAX], *d;
 	size_t count, i;
-	int lc, r, ret;
+	int r, ret = 0;
 
 	count = git_tree_entrycount(tree);
-	for (i = 0; i < count; i++) {
+	for (i = 0; i < count && !ret; i++) {
 		if (!(entry = git_tree_entry_byindex(tree, i)) ||
 		    !(entryname = git_tree_entry_name(entry)))
 			return -1;
+		if (git_tree_entry_type(entry) != GIT_OBJ_TREE)
+			continue;
 		joinpath(entrypath, sizeof(entrypath), path, entryname);
+		r = snprintf(pagepath, sizeof(pagepath), "tree/%s.html", entrypath);
+		if (r < 0 || (size_t)r >= sizeof(pagepath))
+			errx(1, "path truncated: 'tree/%s.html'", entrypath);
+		if (pageindex_unchanged(pagepath, git_tree_entry_id(entry)))
+			continue;
+		if (git_tree_entry_to_object(&obj, repo, entry))
+			continue;
 
-		r = snprintf(filepath, sizeof(filepath), "file/%s.html",
-		         entrypath);
-		if (r < 0 || (size_t)r >= sizeof(filepath))
-			errx(1, "path truncated: 'file/%s.html'", entrypath);
+		if (strlcpy(rel, pagepath, sizeof(rel)) >= sizeof(rel))
+			errx(1, "path truncated: '%s'", pagepath);
+		if (!(d = dirname(rel)))
+			err(1, "dirname");
+		if (outmkdir(d))
+			err(1, "mkdir: '%s'", d);
+		for (p = pagepath, rel[0] = '\0'; *p; p++)
+			if (*p == '/' && strlcat(rel, "../", sizeof(rel)) >= sizeof(rel))
+				errx(1, "path truncated: '../%s'", rel);
+
+		o = outopen(pagepath);
+		relpath = rel;
+		writeheader(o->fp, entrypath);
+		relpath = "";
+		fputs("<p> ", o->fp);
+		xmlencode(o->fp, entrypath, strlen(entrypath));
+		fputs("</p><hr/>", o->fp);
+		writetreehead(o->fp);
+		/* link to the parent directory */
+		fputs("<tr><td>d---------</td><td><a href=\"", o->fp);
+		if (path[0]) {
+			fputs(rel, o->fp);
+			fputs("tree/", o->fp);
+			xmlencode(o->fp, path, strlen(path));
+			fputs(".html", o->fp);
+		} else {
+			fprintf(o->fp, "%sfiles.html", rel);
+		}
+		fputs("\">..</a></td><td class=\"num\" align=\"right\">", o->fp);
+		if (filehistory)
+			fputs("</td><td>", o->fp);
+		fputs("</td></tr>\n", o->fp);
+		ret = writetreeentries(o->fp, (git_tree *)obj, entrypath, rel);
+		fputs("</tbody></table>", o->fp);
+		writefooter(o->fp);
+		outclose(o);
+
+		/* NOTE: recurses */
+		if (!ret)
+			ret = writetreepages((git_tree *)obj, entrypath);
+		if (!ret)
+			pageindex_set(pagepath, git_tree_entry_id(entry), 0, 0);
+		git_object_free(obj);
+	}
 
-		if (!git_tree_entry_to_object(&obj, repo, entry)) {
-			switch (git_object_type(obj)) {
-			case GIT_OBJ_BLOB:
+	return ret;
+}
+
+int
+writefiles(FILE *fp, const git_oid *id)
+{
+	git_tree *tree = NULL;
+	git_commit *commit = NULL;
+	size_t key;
+	int ret = -1;
+
+	writetreehead(fp);
+
+	if (!git_commit_lookup(&commit, repo, id) &&
+	    !git_commit_tree(&tree, commit)) {
+		if (treepages) {
+			/* only the root tree is listed, subtrees have their own
+			   page */
+			key = settingskey();
+			pageindex_read(key);
+			outmkdir("tree");
+			ret = writetreeentries(fp, tree, "", "");
+			if (!ret)
+				ret = writetreepages(tree, "");
+			if (!ret)
+				pageindex_write(key, tree);
+			pageindex_free();
+		} else {
+			ret = writefilestree(fp, tree, "");
+		}
+	}
+
+	fputs("</tbody></table>", fp);
+
+	git_commit_free(commit);
+	git_tree_free(tree);
+
+	return ret;
+}
+
+/* blame pages (-B): "blame/<path>.html" of the files of HEAD. The commits
+   of the lines are stored in "blame/<path>.txt" as "oid count" runs and
+   blame.txt stores the blob and commit of each blame, so the blame of a
+   changed file only follows the commits since the last run. The index is
+   not in blame/, where it would be the lines of a file "index". */
+struct blamefile {
+	char *path;
+	git_oid blob;
+	int cached;               /* blamed by a run before */
+	git_oid oldblob, oldcommit;
+	git_oid *old;             /* commits of the lines of the last run */
+	size_t nold;
+	git_oid *lines;           /* commits of the lines, set when blamed */
+	size_t nlines;
+	int binary;
+	int done;
+};
+
+struct blamejobs {
+	struct blamefile **files;
+	size_t n;
+	size_t next;              /* next file to blame */
+	const git_oid *head;
+	double deadline;          /* end of the time budget, 0 for none */
+	pthread_mutex_t lock;
+};
+
+struct blameentry {
+	git_oid blob;
+	git_oid commit;
+	int seen; /* the file is in HEAD */
+};
+
+/* key of the header and the limits of the blame pages */
+size_t
+blamekey(void)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, key;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		err(1, "open_memstream");
+	relpath = "../";
+	writeheader(fp, "");
+	relpath = "";
+	fprintf(fp, "%d %lld %lld\n", BLAMEVERSION, maxblobbytes, maxbloblines);
+	if (ferror(fp) || fclose(fp))
+		err(1, "fwrite");
+	key = strhash(buf);
+	free(buf);
+
+	return key;
+}
+
+/* read blame.txt: "blob commit path" lines, returns the key */
+size_t
+blameindex_read(struct strtab *t)
+{
+	struct strtabentry *e;
+	struct blameentry *be;
+	FILE *fp;
+	char *line = NULL, *buf;
+	size_t linesiz = 0, key = 0;
+	ssize_t linelen;
+
+	if (!(fp = outfopen("blame.txt", &buf)))
+		return 0;
+	if (fscanf(fp, "%zx\n", &key) != 1)
+		key = 0;
+	while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen < GIT_OID_HEXSZ * 2 + 3 || line[GIT_OID_HEXSZ] != ' ' ||
+		    line[GIT_OID_HEXSZ * 2 + 1] != ' ')
+			continue;
+		e = strtab_get(t, line + GIT_OID_HEXSZ * 2 + 2);
+		if (!(be = e->data) && !(be = e->data = calloc(1, sizeof(*be))))
+			err(1, "calloc");
+		if (git_oid_fromstrn(&(be->blob), line, GIT_OID_HEXSZ) ||
+		    git_oid_fromstrn(&(be->commit), line + GIT_OID_HEXSZ + 1,
+		                     GIT_OID_HEXSZ))
+			memset(be, 0, sizeof(*be));
+	}
+	free(line);
+	outfclose(fp, buf);
+
+	return key;
+}
+
+/* collect the text and executable files of a tree */
+int
+blame_collect(git_tree *tree, const char *path, struct blamefile ***files,
+	size_t *nfiles, size_t *cap)
+{
+	const git_tree_entry *entry;
+	struct blamefile *bf;
+	git_tree *subtree;
+	char entrypath[PATH_MAX];
+	size_t count, i;
+	int ret;
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(tree, i)))
+			return -1;
+		joinpath(entrypath, sizeof(entrypath), path,
+		         git_tree_entry_name(entry));
+
+		switch (git_tree_entry_filemode(entry)) {
+		case GIT_FILEMODE_TREE:
+			if (git_tree_lookup(&subtree, repo, git_tree_entry_id(entry)))
+				return -1;
+			/* NOTE: recurses */
+			ret = blame_collect(subtree, entrypath, files, nfiles, cap);
+			git_tree_free(subtree);
+			if (ret)
+				return ret;
+			break;
+		case GIT_FILEMODE_BLOB:
+		case GIT_FILEMODE_BLOB_EXECUTABLE:
+			if (*nfiles == *cap) {
+				*cap = *cap ? *cap * 2 : 256;
+				if (!(*files = reallocarray(*files, *cap, sizeof(**files))))
+					err(1, "realloc");
+			}
+			if (!(bf = calloc(1, sizeof(*bf))) ||
+			    !(bf->path = strdup(entrypath)))
+				err(1, "calloc");
+			git_oid_cpy(&(bf->blob), git_tree_entry_id(entry));
+			(*files)[(*nfiles)++] = bf;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* read the commits of the lines of the last run, none when they do not
+   exist */
+void
+blame_readlines(struct blamefile *bf)
+{
+	FILE *fp;
+	git_oid id;
+	char path[PATH_MAX], line[128], *buf, *p;
+	size_t n, cap = 0;
+	int r;
+
+	r = snprintf(path, sizeof(path), "blame/%s.txt", bf->path);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'blame/%s.txt'", bf->path);
+	if (!(fp = outfopen(path, &buf)))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strlen(line) < GIT_OID_HEXSZ + 2 || line[GIT_OID_HEXSZ] != ' ' ||
+		    git_oid_fromstrn(&id, line, GIT_OID_HEXSZ))
+			break;
+		n = strtoull(line + GIT_OID_HEXSZ + 1, &p, 10);
+		if (*p != '\n')
+			break;
+		if (bf->nold + n > cap) {
+			cap = bf->nold + n > cap * 2 ? bf->nold + n : cap * 2;
+			if (!(bf->old = reallocarray(bf->old, cap, sizeof(*bf->old))))
+				err(1, "realloc");
+		}
+		for (; n > 0; n--)
+			git_oid_cpy(&(bf->old[bf->nold++]), &id);
+	}
+	outfclose(fp, buf);
+}
+
+/* are lines traced to the commit of the last run not in its lines: at
+   another path, or after the lines that were shown then */
+int
+blame_oldmissing(git_blame *blame, struct blamefile *bf)
+{
+	const git_blame_hunk *h;
+	uint32_t i, n;
+
+	n = git_blame_get_hunk_count(blame);
+	for (i = 0; i < n; i++) {
+		h = git_blame_get_hunk_byindex(blame, i);
+		if (!git_oid_equal(&(h->final_commit_id), &(bf->oldcommit)))
+			continue;
+		if ((h->orig_path && strcmp(h->orig_path, bf->path)) ||
+		    h->orig_start_line_number - 1 + h->lines_in_hunk > bf->nold)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* blame the lines of a file at head that are shown within the limits of
+   the file pages. with the lines of the last run only the commits since
+   then are followed, the lines that are older than the commit of the last
+   run keep their commit. */
+int
+blame_compute(struct blamefile *bf, const git_oid *head)
+{
+	git_blame_options opts;
+	git_blame *blame;
+	git_blob *blob;
+	const git_blame_hunk *h;
+	size_t i, k, n, line, o, nshown, shown, size;
+	uint32_t nhunks;
+
+	if (git_blob_lookup(&blob, repo, &(bf->blob)))
+		return -1;
+	bf->binary = git_blob_is_binary(blob);
+	size = git_blob_rawsize(blob);
+	nshown = blobshownlines(git_blob_rawcontent(blob), size, &shown);
+	git_blob_free(blob);
+	if (bf->binary || !nshown)
+		return 0;
+
+	for (;;) {
+		git_blame_init_options(&opts, GIT_BLAME_OPTIONS_VERSION);
+		git_oid_cpy(&(opts.newest_commit), head);
+		if (bf->nold)
+			git_oid_cpy(&(opts.oldest_commit), &(bf->oldcommit));
+		if (shown < size)
+			opts.max_line = nshown;
+		if (git_blame_file(&blame, repo, bf->path, &opts)) {
+			/* the commit of the last run may not exist anymore */
+			if (!bf->nold)
+				return -1;
+			bf->nold = 0;
+			continue;
+		}
+		if (!bf->nold || !blame_oldmissing(blame, bf))
+			break;
+		/* the lines of the last run are of another file or truncated */
+		git_blame_free(blame);
+		bf->nold = 0;
+	}
+
+	nhunks = git_blame_get_hunk_count(blame);
+	for (i = 0, n = 0; i < nhunks; i++)
+		n += git_blame_get_hunk_byindex(blame, i)->lines_in_hunk;
+	if (n && !(bf->lines = calloc(n, sizeof(*bf->lines))))
+		err(1, "calloc");
+	bf->nlines = n;
+	for (i = 0; i < nhunks; i++) {
+		h = git_blame_get_hunk_byindex(blame, i);
+		for (k = 0; k < h->lines_in_hunk; k++) {
+			line = h->final_start_line_number - 1 + k;
+			if (line >= n)
 				break;
-			case GIT_OBJ_TREE:
-				/* NOTE: recurses */
-				ret = writefilestree(fp, (git_tree *)obj,
-				                     entrypath);
-				git_object_free(obj);
-				if (ret)
-					return ret;
+			o = h->orig_start_line_number - 1 + k;
+			if (bf->nold && o < bf->nold &&
+			    git_oid_equal(&(h->final_commit_id), &(bf->oldcommit)))
+				git_oid_cpy(&(bf->lines[line]), &(bf->old[o]));
+			else
+				git_oid_cpy(&(bf->lines[line]), &(h->final_commit_id));
+		}
+	}
+	git_blame_free(blame);
+
+	return 0;
+}
+
+void *
+blame_worker(void *arg)
+{
+	struct blamejobs *bj = arg;
+	struct blamefile *bf;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&(bj->lock));
+		i = bj->next++;
+		pthread_mutex_unlock(&(bj->lock));
+		if (i >= bj->n || (bj->deadline && monotime() >= bj->deadline))
+			break;
+		bf = bj->files[i];
+		if (blame_compute(bf, bj->head))
+			warnx("%s: cannot blame", bf->path);
+		else
+			bf->done = 1;
+	}
+
+	return NULL;
+}
+
+/* write the page of a blame, or a page that it is not written yet */
+void
+writeblamepage(struct blamefile *bf)
+{
+	struct output *o;
+	git_commit *commit = NULL;
+	git_blob *blob = NULL;
+	const git_signature *author;
+	const char *s, *summary, *t, *filename;
+	char path[PATH_MAX], tmp[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1], *d;
+	size_t i, n, prev, len, tlen, nshown, shown;
+	git_off_t size;
+	int r;
+
+	r = snprintf(path, sizeof(path), "blame/%s.html", bf->path);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'blame/%s.html'", bf->path);
+	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '%s'", path);
+	if (!(d = dirname(tmp)))
+		err(1, "dirname");
+	if (outmkdir(d))
+		err(1, "mkdir: '%s'", d);
+	for (s = path, tmp[0] = '\0'; *s; s++) {
+		if (*s == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	relpath = tmp;
+	filename = (s = strrchr(bf->path, '/')) ? s + 1 : bf->path;
+
+	o = outopen(path);
+	writeheader(o->fp, filename);
+	fprintf(o->fp, "<p> <a href=\"%sfile/", relpath);
+	xmlencode(o->fp, bf->path, strlen(bf->path));
+	fputs(".html\">", o->fp);
+	xmlencode(o->fp, filename, strlen(filename));
+	fputs("</a> (blame)</p><hr/>", o->fp);
+
+	if (bf->binary) {
+		fputs("<p>Binary file.</p>\n", o->fp);
+	} else if (!bf->done || git_blob_lookup(&blob, repo, &(bf->blob))) {
+		fputs("<p>The blame of this file is not written yet.</p>\n", o->fp);
+	} else {
+		s = git_blob_rawcontent(blob);
+		size = git_blob_rawsize(blob);
+		nshown = blobshownlines(s, size, &shown);
+		fputs("<pre id=\"blame\">\n", o->fp);
+		/* each line including trailing data without a newline */
+		for (i = 0, n = 0, prev = 0; prev < shown; i++) {
+			if (i < shown && s[i] != '\n')
 				continue;
-			default:
-				git_object_free(obj);
+			len = i < shown ? i + 1 - prev : shown - prev;
+			/* the commit at the first line of each run */
+			if (n < bf->nlines &&
+			    (!n || !git_oid_equal(&(bf->lines[n]), &(bf->lines[n - 1])))) {
+				git_commit_free(commit);
+				commit = NULL;
+				git_oid_tostr(oidstr, sizeof(oidstr), &(bf->lines[n]));
+				fprintf(o->fp, "<a href=\"%scommit/%s.html\"", relpath, oidstr);
+				if (!git_commit_lookup(&commit, repo, &(bf->lines[n]))) {
+					author = git_commit_author(commit);
+					summary = git_commit_summary(commit);
+					fputs(" title=\"", o->fp);
+					if (author)
+						xmlencode(o->fp, author->name, strlen(author->name));
+					if (author && summary)
+						fputs(": ", o->fp);
+					if (summary)
+						xmlencode(o->fp, summary, strlen(summary));
+					fputs("\"", o->fp);
+				}
+				fprintf(o->fp, ">%.7s</a> ", oidstr);
+				/* the date of "YYYY-MM-DD HH:MM" */
+				if (commit && (author = git_commit_author(commit)) &&
+				    (t = fmttime(&(author->when), TimeShort, &tlen)) &&
+				    tlen >= 10)
+					fwrite(t, 1, 10, o->fp);
+				else
+					fputs("          ", o->fp);
+				fputc(' ', o->fp);
+			} else {
+				fputs("                   ", o->fp);
+			}
+			n++;
+			printlineno(o->fp, n);
+			xmlencode(o->fp, &s[prev], len);
+			prev += len;
+		}
+		fputs("</pre>\n", o->fp);
+		writeblobtruncated(o->fp, s, size, shown, nshown);
+		git_commit_free(commit);
+		git_blob_free(blob);
+	}
+	writefooter(o->fp);
+	outclose(o);
+
+	relpath = "";
+}
+
+/* store the commits of the lines as "oid count" runs */
+void
+writeblamelines(struct blamefile *bf)
+{
+	struct output *o;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
+	size_t i, j;
+	int r;
+
+	r = snprintf(path, sizeof(path), "blame/%s.txt", bf->path);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'blame/%s.txt'", bf->path);
+	o = outopen(path);
+	for (i = 0; i < bf->nlines; i = j) {
+		for (j = i + 1; j < bf->nlines &&
+		     git_oid_equal(&(bf->lines[j]), &(bf->lines[i])); j++)
+			;
+		git_oid_tostr(oidstr, sizeof(oidstr), &(bf->lines[i]));
+		fprintf(o->fp, "%s %zu\n", oidstr, j - i);
+	}
+	outclose(o);
+}
+
+/* remove the page and lines of a file */
+void
+blame_remove(const char *file)
+{
+	char path[PATH_MAX];
+	int r;
+
+	r = snprintf(path, sizeof(path), "blame/%s.html", file);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'blame/%s.html'", file);
+	outremove(path);
+	/* the same length as the page */
+	memcpy(path + r - strlen(".html"), ".txt", sizeof(".txt"));
+	outremove(path);
+}
+
+/* write the blame pages of the files of head that changed since the last
+   run. the files are blamed in parallel until the time budget of blametime
+   seconds is used, the others are blamed by the next runs. */
+void
+writeblames(const git_oid *head)
+{
+	struct blamejobs bj;
+	struct blamefile **files = NULL, **stale = NULL, *bf;
+	struct strtab index;
+	struct strtabentry *e;
+	struct oidset ancestors;
+	struct oidsetentry *ae;
+	struct blameentry *be;
+	struct output *o;
+	git_commit *commit = NULL;
+	git_tree *tree = NULL;
+	git_blob *blob;
+	pthread_t *threads;
+	char blobstr[GIT_OID_HEXSZ + 1], oidstr[GIT_OID_HEXSZ + 1];
+	size_t nfiles = 0, cap = 0, nstale = 0, ndone = 0, key, batch, b, i;
+	size_t nshown, shown;
+	long n, t;
+	int r, rerender;
+
+	if (git_commit_lookup(&commit, repo, head) ||
+	    git_commit_tree(&tree, commit))
+		errx(1, "cannot read the tree of HEAD");
+	if (outmkdir("blame"))
+		err(1, "mkdir: 'blame'");
+	if (blame_collect(tree, "", &files, &nfiles, &cap))
+		errx(1, "cannot read the tree of HEAD");
+	git_tree_free(tree);
+	git_commit_free(commit);
+
+	memset(&index, 0, sizeof(index));
+	memset(&ancestors, 0, sizeof(ancestors));
+	key = blamekey();
+	rerender = blameindex_read(&index) != key;
+
+	if (nfiles && !(stale = reallocarray(NULL, nfiles, sizeof(*stale))))
+		err(1, "reallocarray");
+	for (i = 0; i < nfiles; i++) {
+		bf = files[i];
+		if ((e = strtab_find(&index, bf->path)) && e->key && e->data) {
+			be = e->data;
+			be->seen = 1;
+			/* only a blame of a commit of the history of HEAD is used,
+			   after a rewrite the file is blamed again. a zero commit
+			   is of a page that is not written yet */
+			if (git_oid_iszero(&(be->commit))) {
+				ae = NULL;
+			} else if (!(ae = oidset_get(&ancestors, &(be->commit)))) {
+				ae = oidset_add(&ancestors, &(be->commit));
+				ae->seen = git_oid_equal(&(be->commit), head) ||
+				    git_graph_descendant_of(repo, head, &(be->commit)) == 1;
+			}
+			if (ae && ae->seen) {
+				bf->cached = 1;
+				git_oid_cpy(&(bf->oldblob), &(be->blob));
+				git_oid_cpy(&(bf->oldcommit), &(be->commit));
+			}
+		}
+		if (!bf->cached || !git_oid_equal(&(bf->oldblob), &(bf->blob))) {
+			stale[nstale++] = bf;
+			continue;
+		}
+		/* the page is of the blame of the last run */
+		if (rerender) {
+			blame_readlines(bf);
+			if (git_blob_lookup(&blob, repo, &(bf->blob))) {
+				stale[nstale++] = bf;
 				continue;
 			}
+			/* a binary file has no lines */
+			bf->binary = git_blob_is_binary(blob);
+			nshown = blobshownlines(git_blob_rawcontent(blob),
+			                        git_blob_rawsize(blob), &shown);
+			git_blob_free(blob);
+			/* the limits changed: more lines are shown */
+			if (!bf->binary && bf->nold < nshown) {
+				free(bf->old);
+				bf->old = NULL;
+				bf->nold = 0;
+				stale[nstale++] = bf;
+				continue;
+			}
+			bf->lines = bf->old;
+			bf->nlines = bf->binary ? 0 : nshown;
+			bf->old = NULL;
+			bf->nold = 0;
+			bf->done = 1;
+			writeblamepage(bf);
+			free(bf->lines);
+			bf->lines = NULL;
+		}
+		bf->done = 1;
+	}
+	/* the pages of the files that are not in HEAD anymore */
+	for (i = 0; i < index.cap; i++) {
+		if (index.entries[i].key && (be = index.entries[i].data) &&
+		    !be->seen)
+			blame_remove(index.entries[i].key);
+		free(index.entries[i].data);
+	}
+	strtab_free(&index);
+	oidset_free(&ancestors);
+
+	if (verbose && nstale)
+		fprintf(stderr, "%zu of %zu blame pages are stale\n", nstale, nfiles);
+
+	n = nthreads();
+	batch = n * 4;
+	if (!(threads = reallocarray(NULL, n, sizeof(*threads))))
+		err(1, "reallocarray");
+	pthread_mutex_init(&(bj.lock), NULL);
+	bj.head = head;
+	/* the scratch run of -V blames all files */
+	bj.deadline = blametime && !verifydir[0] ? monotime() + blametime : 0;
+	for (b = 0; b < nstale; b += batch) {
+		bj.files = stale + b;
+		bj.n = nstale - b < batch ? nstale - b : batch;
+		bj.next = 0;
+		if (!bj.deadline || monotime() < bj.deadline) {
+			for (i = 0; i < bj.n; i++)
+				if (bj.files[i]->cached)
+					blame_readlines(bj.files[i]);
+			/* the main thread blames too */
+			for (t = 0; t + 1 < n && (size_t)t + 1 < bj.n; t++) {
+				if ((r = pthread_create(&threads[t], NULL, blame_worker, &bj))) {
+					errno = r;
+					err(1, "pthread_create");
+				}
+			}
+			blame_worker(&bj);
+			while (t > 0)
+				pthread_join(threads[--t], NULL);
+		}
+		for (i = 0; i < bj.n; i++) {
+			bf = bj.files[i];
+			writeblamepage(bf);
+			if (bf->done) {
+				if (!bf->binary)
+					writeblamelines(bf);
+				git_oid_cpy(&(bf->oldblob), &(bf->blob));
+				git_oid_cpy(&(bf->oldcommit), head);
+				ndone++;
+			}
+			free(bf->old);
+			free(bf->lines);
+			bf->old = bf->lines = NULL;
+		}
+	}
+	pthread_mutex_destroy(&(bj.lock));
+	free(threads);
+
+	if (verbose && ndone < nstale)
+		fprintf(stderr, "%zu blame pages are left for the next run\n",
+		        nstale - ndone);
+
+	/* the blame of the last run of a file that was not blamed again is kept:
+	   the next run continues from it */
+	o = outopen("blame.txt");
+	fprintf(o->fp, "%zx\n", key);
+	for (i = 0; i < nfiles; i++) {
+		bf = files[i];
+		/* a zero blob and commit for a page that is not written yet */
+		if (!bf->done && !bf->cached) {
+			memset(&(bf->oldblob), 0, sizeof(bf->oldblob));
+			memset(&(bf->oldcommit), 0, sizeof(bf->oldcommit));
+		}
+		git_oid_tostr(blobstr, sizeof(blobstr), &(bf->oldblob));
+		git_oid_tostr(oidstr, sizeof(oidstr), &(bf->oldcommit));
+		/* a newline in a path cannot be stored in the index */
+		if (!strchr(bf->path, '\n'))
+			fprintf(o->fp, "%s %s %s\n", blobstr, oidstr, bf->path);
+		free(bf->path);
+		free(bf);
+	}
+	outclose(o);
+	free(stale);
+	free(files);
+}
+
+/* archives of the tags (-z): "archives/<name>-<tag>.tar.gz", the tar data is
+   streamed from the tree of the tag to gzip, one blob at a time */
+struct tagarchive {
+	char path[PATH_MAX];   /* of the archive */
+	char prefix[PATH_MAX]; /* directory of the entries: "<name>-<tag>/" */
+	char oid[GIT_OID_HEXSZ + 1]; /* of the commit */
+	git_oid treeid;
+	git_time_t mtime;
+	int write;  /* new or moved since the last run */
+	int failed;
+};
+
+struct tagarchives {
+	struct tagarchive *archives;
+	size_t n;
+	size_t next; /* next archive to write */
+	pthread_mutex_t lock;
+};
+
+static const char tarzero[1024];
+
+/* file name of the archive of a tag, a '/' in the tag is replaced by '_' */
+void
+tagarchivename(char *buf, size_t bufsiz, const char *tag)
+{
+	char *p;
+	int r;
+
+	r = snprintf(buf, bufsiz, "%s-%s", strippedname, tag);
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: '%s-%s'", strippedname, tag);
+	for (p = buf; *p; p++)
+		if (*p == '/')
+			*p = '_';
+}
+
+void
+tar_write(gzFile gz, const void *buf, size_t len)
+{
+	const char *p = buf;
+	unsigned n;
+	int r;
+
+	/* gzwrite() takes an unsigned length */
+	for (; len > 0; p += r, len -= r) {
+		n = len < (1U << 30) ? len : (1U << 30);
+		if ((r = gzwrite(gz, p, n)) <= 0)
+			errx(1, "gzwrite: %s", gzerror(gz, &r));
+	}
+}
+
+/* zero bytes up to the next block of 512 bytes */
+void
+tar_pad(gzFile gz, uintmax_t size)
+{
+	if (size % 512)
+		tar_write(gz, tarzero, 512 - size % 512);
+}
+
+void
+tar_octal(char *field, size_t fieldsiz, uintmax_t n)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%0*jo", (int)fieldsiz - 1, n);
+	memcpy(field, buf, fieldsiz);
+}
+
+/* ustar header block */
+void
+tar_block(gzFile gz, const char *name, size_t namelen, const char *prefix,
+	size_t prefixlen, int type, unsigned mode, uintmax_t size,
+	const char *linkname, git_time_t mtime)
+{
+	char h[512];
+	unsigned sum;
+	size_t i;
+
+	memset(h, 0, sizeof(h));
+	memcpy(h, name, namelen < 100 ? namelen : 100);
+	tar_octal(h + 100, 8, mode);
+	tar_octal(h + 108, 8, 0);
+	tar_octal(h + 116, 8, 0);
+	tar_octal(h + 124, 12, size);
+	tar_octal(h + 136, 12, mtime > 0 ? (uintmax_t)mtime : 0);
+	h[156] = type;
+	if (linkname)
+		strncpy(h + 157, linkname, 100);
+	memcpy(h + 257, "ustar\0" "00", 8);
+	memcpy(h + 265, "root", 4);
+	memcpy(h + 297, "root", 4);
+	tar_octal(h + 329, 8, 0);
+	tar_octal(h + 337, 8, 0);
+	if (prefix)
+		memcpy(h + 345, prefix, prefixlen);
+
+	memset(h + 148, ' ', 8);
+	for (i = 0, sum = 0; i < sizeof(h); i++)
+		sum += (unsigned char)h[i];
+	snprintf(h + 148, 8, "%06o", sum);
+
+	tar_write(gz, h, sizeof(h));
+}
+
+/* append the pax record "<length> key=value\n" to buf, returns its length */
+size_t
+tar_paxrecord(char *buf, const char *key, const char *value)
+{
+	size_t n, d;
+
+	/* the length includes its own digits */
+	n = strlen(key) + strlen(value) + 3;
+	for (d = 1; (size_t)snprintf(NULL, 0, "%zu", n + d) != d; d++)
+		;
+
+	return sprintf(buf, "%zu %s=%s\n", n + d, key, value);
+}
+
+/* header of an entry: a path that does not fit in the name field is split
+   in the prefix and name fields, else it, a long link name and a size that
+   does not fit in the 11 octal digits of the size field (8 GiB) are stored in
+   a pax header, as git archive does */
+void
+tar_header(gzFile gz, const char *path, int type, unsigned mode,
+	uintmax_t size, const char *linkname, git_time_t mtime)
+{
+	char *pax, sizestr[32];
+	size_t len, linklen, paxlen, s;
+	int bigsize;
+
+	len = strlen(path);
+	linklen = linkname ? strlen(linkname) : 0;
+	bigsize = size > 077777777777;
+	if (len <= 100 && linklen <= 100 && !bigsize) {
+		tar_block(gz, path, len, NULL, 0, type, mode, size, linkname, mtime);
+		return;
+	}
+	if (linklen <= 100 && !bigsize) {
+		for (s = len > 101 ? len - 101 : 0; s < len && s <= 155; s++) {
+			/* the name part of a directory is more than its '/' */
+			if (path[s] == '/' && s + 1 < len && path[s + 1] != '/' &&
+			    (type != '5' || s + 2 < len)) {
+				tar_block(gz, path + s + 1, len - s - 1, path, s,
+				          type, mode, size, linkname, mtime);
+				return;
+			}
+		}
+	}
 
-			filesize = git_blob_rawsize((git_blob *)obj);
-			lc = writeblob(obj, filepath, entryname, filesize);
+	if (!(pax = malloc(len + linklen + 128)))
+		err(1, "malloc");
+	paxlen = 0;
+	if (len > 100)
+		paxlen += tar_paxrecord(pax + paxlen, "path", path);
+	if (linklen > 100)
+		paxlen += tar_paxrecord(pax + paxlen, "linkpath", linkname);
+	if (bigsize) {
+		snprintf(sizestr, sizeof(sizestr), "%ju", size);
+		paxlen += tar_paxrecord(pax + paxlen, "size", sizestr);
+	}
+	tar_block(gz, "././@PaxHeader", strlen("././@PaxHeader"), NULL, 0,
+	          'x', 0644, paxlen, NULL, mtime);
+	tar_write(gz, pax, paxlen);
+	tar_pad(gz, paxlen);
+	free(pax);
+
+	tar_block(gz, path, len, NULL, 0, type, mode, bigsize ? 0 : size,
+	          linkname, mtime);
+}
 
-			fputs("<tr><td>", fp);
-			fputs(filemode(git_tree_entry_filemode(entry)), fp);
-			fprintf(fp, "</td><td><a href=\"%s", relpath);
-			xmlencode(fp, filepath, strlen(filepath));
-			fputs("\">", fp);
-			xmlencode(fp, entrypath, strlen(entrypath));
-			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
-			if (lc > 0)
-				fprintf(fp, "%dL", lc);
-			else
-				fprintf(fp, "%juB", (uintmax_t)filesize);
-			fputs("</td></tr>\n", fp);
-			git_object_free(obj);
-		} else if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT) {
-			/* commit object in tree is a submodule */
-			fprintf(fp, "<tr><td>m---------</td><td><a href=\"%sfile/.gitmodules.html\">",
-				relpath);
-			xmlencode(fp, entrypath, strlen(entrypath));
-			fputs("</a></td><td class=\"num\" align=\"right\"></td></tr>\n", fp);
+/* write the entries of a tree, the modes are the ones of git archive */
+int
+tar_tree(gzFile gz, git_tree *tree, const char *path, git_time_t mtime)
+{
+	const git_tree_entry *entry;
+	git_tree *subtree;
+	git_blob *blob;
+	char entrypath[PATH_MAX], linkname[PATH_MAX];
+	uintmax_t size;
+	size_t count, i;
+	int ret;
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(tree, i)))
+			return -1;
+		joinpath(entrypath, sizeof(entrypath), path,
+		         git_tree_entry_name(entry));
+
+		switch (git_tree_entry_filemode(entry)) {
+		case GIT_FILEMODE_TREE:
+			if (strlcat(entrypath, "/", sizeof(entrypath)) >= sizeof(entrypath))
+				errx(1, "path truncated: '%s/'", entrypath);
+			tar_header(gz, entrypath, '5', 0775, 0, NULL, mtime);
+			if (git_tree_lookup(&subtree, repo, git_tree_entry_id(entry)))
+				return -1;
+			/* NOTE: recurses */
+			ret = tar_tree(gz, subtree, entrypath, mtime);
+			git_tree_free(subtree);
+			if (ret)
+				return ret;
+			break;
+		case GIT_FILEMODE_COMMIT:
+			/* a submodule is an empty directory */
+			if (strlcat(entrypath, "/", sizeof(entrypath)) >= sizeof(entrypath))
+				errx(1, "path truncated: '%s/'", entrypath);
+			tar_header(gz, entrypath, '5', 0775, 0, NULL, mtime);
+			break;
+		case GIT_FILEMODE_LINK:
+			if (git_blob_lookup(&blob, repo, git_tree_entry_id(entry)))
+				return -1;
+			size = git_blob_rawsize(blob);
+			if (size >= sizeof(linkname)) {
+				git_blob_free(blob);
+				return -1;
+			}
+			memcpy(linkname, git_blob_rawcontent(blob), size);
+			linkname[size] = '\0';
+			git_blob_free(blob);
+			tar_header(gz, entrypath, '2', 0777, 0, linkname, mtime);
+			break;
+		default:
+			if (git_blob_lookup(&blob, repo, git_tree_entry_id(entry)))
+				return -1;
+			size = git_blob_rawsize(blob);
+			tar_header(gz, entrypath, '0',
+			           git_tree_entry_filemode(entry) ==
+			           GIT_FILEMODE_BLOB_EXECUTABLE ? 0775 : 0664,
+			           size, NULL, mtime);
+			tar_write(gz, git_blob_rawcontent(blob), size);
+			tar_pad(gz, size);
+			git_blob_free(blob);
+			break;
 		}
 	}
 
 	return 0;
 }
 
+/* write an archive to a temporary file and rename it */
 int
-writefiles(FILE *fp, const git_oid *id)
+writetagarchive(struct tagarchive *ta)
 {
 	git_tree *tree = NULL;
-	git_commit *commit = NULL;
-	int ret = -1;
+	gzFile gz;
+	char tmppath[PATH_MAX], rec[128];
+	size_t len;
+	int fd, r, ret;
+
+	r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", ta->path);
+	if (r < 0 || (size_t)r >= sizeof(tmppath))
+		errx(1, "path truncated: '%s.XXXXXX'", ta->path);
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp: '%s'", tmppath);
+	if (fchmod(fd, outmode) == -1)
+		err(1, "fchmod: '%s'", tmppath);
+	if (!(gz = gzdopen(fd, "wb")))
+		err(1, "gzdopen: '%s'", tmppath);
+
+	/* the commit id in a global header, as git archive */
+	len = tar_paxrecord(rec, "comment", ta->oid);
+	tar_block(gz, "pax_global_header", strlen("pax_global_header"), NULL, 0,
+	          'g', 0666, len, NULL, ta->mtime);
+	tar_write(gz, rec, len);
+	tar_pad(gz, len);
+
+	tar_header(gz, ta->prefix, '5', 0775, 0, NULL, ta->mtime);
+	if (git_tree_lookup(&tree, repo, &(ta->treeid)))
+		ret = -1;
+	else
+		ret = tar_tree(gz, tree, ta->prefix, ta->mtime);
+	git_tree_free(tree);
+	/* end of archive */
+	tar_write(gz, tarzero, sizeof(tarzero));
 
-	fputs("<table id=\"files\"><thead>\n<tr>"
-	      "<td><b>Mode</b></td><td><b>Name</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>Size</b></td>"
-	      "</tr>\n</thead><tbody>\n", fp);
+	if (gzclose(gz) != Z_OK)
+		errx(1, "gzclose: '%s'", tmppath);
+	if (ret) {
+		unlink(tmppath);
+		return -1;
+	}
+	if (rename(tmppath, ta->path))
+		err(1, "rename: '%s' to '%s'", tmppath, ta->path);
 
-	if (!git_commit_lookup(&commit, repo, id) &&
-	    !git_commit_tree(&tree, commit))
-		ret = writefilestree(fp, tree, "");
+	return 0;
+}
 
-	fputs("</tbody></table>", fp);
+void *
+tagarchives_worker(void *arg)
+{
+	struct tagarchives *tas = arg;
+	size_t i;
 
-	git_commit_free(commit);
-	git_tree_free(tree);
+	for (;;) {
+		pthread_mutex_lock(&(tas->lock));
+		i = tas->next++;
+		pthread_mutex_unlock(&(tas->lock));
+		if (i >= tas->n)
+			break;
+		if (!tas->archives[i].write)
+			continue;
+		if ((tas->archives[i].failed = writetagarchive(&(tas->archives[i]))))
+			warnx("%s: cannot write archive", tas->archives[i].path);
+	}
 
-	return ret;
+	return NULL;
+}
+
+/* write the archives of the tags that are new or point to another commit
+   since the last run, in parallel. archives/index.txt stores the commit of
+   each archive. */
+void
+writetagarchives(struct referenceinfo *ris, size_t refcount)
+{
+	struct tagarchives tas;
+	struct tagarchive *ta;
+	struct strtab written, names;
+	struct strtabentry *e;
+	struct stat st;
+	pthread_t *threads;
+	FILE *fp;
+	const char *tag;
+	char file[PATH_MAX], line[PATH_MAX + GIT_OID_HEXSZ + 2], *p, *buf;
+	size_t i, nwrite = 0, len;
+	long n, t;
+	int r;
+
+	if (mkdir("archives", S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST)
+		err(1, "mkdir: 'archives'");
+
+	/* "oid file" lines of the last run */
+	memset(&written, 0, sizeof(written));
+	if ((fp = fopen("archives/index.txt", "r"))) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (!(p = strchr(line, '\n')) || p - line < GIT_OID_HEXSZ + 2 ||
+			    line[GIT_OID_HEXSZ] != ' ')
+				continue;
+			*p = '\0';
+			line[GIT_OID_HEXSZ] = '\0';
+			e = strtab_get(&written, line + GIT_OID_HEXSZ + 1);
+			free(e->data);
+			if (!(e->data = strdup(line)))
+				err(1, "strdup");
+		}
+		fclose(fp);
+	}
+
+	memset(&tas, 0, sizeof(tas));
+	memset(&names, 0, sizeof(names));
+	for (i = 0; i < refcount; i++) {
+		if (!git_reference_is_tag(ris[i].ref))
+			continue;
+		/* tags that differ only in "/" and "_" have the same name: the
+		   first one in the order of the refs gets the archive */
+		tag = git_reference_shorthand(ris[i].ref);
+		tagarchivename(file, sizeof(file), tag);
+		if ((e = strtab_find(&names, file)) && e->key) {
+			warnx("archive '%s' of tag '%s' is the one of tag '%s', not written",
+			      file, tag, (const char *)e->data);
+			continue;
+		}
+		strtab_get(&names, file)->data = (void *)tag;
+		ris[i].archive = 1;
+
+		if (!(tas.archives = reallocarray(tas.archives, tas.n + 1,
+		                                  sizeof(*tas.archives))))
+			err(1, "realloc");
+		ta = &(tas.archives[tas.n++]);
+		memset(ta, 0, sizeof(*ta));
+
+		r = snprintf(ta->path, sizeof(ta->path), "archives/%s.tar.gz", file);
+		if (r < 0 || (size_t)r >= sizeof(ta->path))
+			errx(1, "path truncated: 'archives/%s.tar.gz'", file);
+		strlcpy(ta->oid, ris[i].ci->oid, sizeof(ta->oid));
+		/* written by the last run and not moved since */
+		if ((e = strtab_find(&written, ta->path + strlen("archives/"))) &&
+		    e->key && !strcmp(e->data, ta->oid) && !stat(ta->path, &st))
+			continue;
+
+		r = snprintf(ta->prefix, sizeof(ta->prefix), "%s/", file);
+		if (r < 0 || (size_t)r >= sizeof(ta->prefix))
+			errx(1, "path truncated: '%s/'", file);
+		git_oid_cpy(&(ta->treeid), git_commit_tree_id(ris[i].ci->commit));
+		ta->mtime = ris[i].ci->committer ? ris[i].ci->committer->when.time : 0;
+		ta->write = 1;
+		nwrite++;
+	}
+	/* the archives of tags that were deleted */
+	for (i = 0; i < written.cap; i++) {
+		if (!(p = written.entries[i].key))
+			continue;
+		len = strlen(p);
+		if (!strchr(p, '/') && len > strlen(".tar.gz") &&
+		    !strcmp(p + len - strlen(".tar.gz"), ".tar.gz")) {
+			memcpy(file, p, len - strlen(".tar.gz"));
+			file[len - strlen(".tar.gz")] = '\0';
+			if (!(e = strtab_find(&names, file)) || !e->key) {
+				joinpath(line, sizeof(line), "archives", p);
+				if (unlink(line) == -1 && errno != ENOENT)
+					err(1, "unlink: '%s'", line);
+			}
+		}
+		free(written.entries[i].data);
+	}
+	strtab_free(&written);
+	strtab_free(&names);
+
+	if (verbose && nwrite)
+		fprintf(stderr, "%zu tag archives are written\n", nwrite);
+
+	n = nthreads();
+	if (!(threads = reallocarray(NULL, n, sizeof(*threads))))
+		err(1, "reallocarray");
+	pthread_mutex_init(&(tas.lock), NULL);
+	/* the main thread writes too */
+	for (t = 0; t + 1 < n && (size_t)t + 1 < nwrite; t++) {
+		if ((r = pthread_create(&threads[t], NULL, tagarchives_worker, &tas))) {
+			errno = r;
+			err(1, "pthread_create");
+		}
+	}
+	tagarchives_worker(&tas);
+	while (t > 0)
+		pthread_join(threads[--t], NULL);
+	pthread_mutex_destroy(&(tas.lock));
+	free(threads);
+
+	/* a failed archive is written again by the next run */
+	for (i = 0, len = 1; i < tas.n; i++)
+		len += GIT_OID_HEXSZ + 2 + strlen(tas.archives[i].path);
+	if (!(buf = malloc(len)))
+		err(1, "malloc");
+	for (i = 0, len = 0; i < tas.n; i++)
+		if (!tas.archives[i].failed)
+			len += sprintf(buf + len, "%s %s\n", tas.archives[i].oid,
+			               tas.archives[i].path + strlen("archives/"));
+	writeatomic("archives/index.txt", buf, len);
+	free(buf);
+	free(tas.archives);
 }
 
 int
@@ -1069,9 +6168,12 @@ writerefs(FILE *fp)
 	const char *titles[] = { "Branches", "Tags" };
 	const char *ids[] = { "branches", "tags" };
 	const char *s;
+	char path[PATH_MAX];
 
 	if (getrefs(&ris, &refcount) == -1)
 		return -1;
+	if (tarballs)
+		writetagarchives(ris, refcount);
 
 	for (i = 0, j = 0, count = 0; i < refcount; i++) {
 		if (j == 0 && git_reference_is_tag(ris[i].ref)) {
@@ -1095,7 +6197,21 @@ writerefs(FILE *fp)
 		s = git_reference_shorthand(ris[i].ref);
 
 		fputs("<tr><td>", fp);
-		xmlencode(fp, s, strlen(s));
+		if (j == 0 && isbranchlog(s)) {
+			fputs("<a href=\"log/", fp);
+			xmlencode(fp, s, strlen(s));
+			fputs(".html\">", fp);
+			xmlencode(fp, s, strlen(s));
+			fputs("</a>", fp);
+		} else {
+			xmlencode(fp, s, strlen(s));
+		}
+		if (j == 1 && ris[i].archive) {
+			tagarchivename(path, sizeof(path), s);
+			fputs(" <a href=\"archives/", fp);
+			xmlencode(fp, path, strlen(path));
+			fputs(".tar.gz\">tar.gz</a>", fp);
+		}
 		fputs("</td><td>", fp);
 		if (ci->author)
 			printtimeshort(fp, &(ci->author->when));
@@ -1117,24 +6233,328 @@ writerefs(FILE *fp)
 	return 0;
 }
 
+/* read the "old new ref" lines of a post-receive hook from stdin and
+   select the outputs of the updated refs */
+void
+readrefupdates(void)
+{
+	git_reference *ref = NULL;
+	const char *headname = NULL;
+	char *line = NULL, *p, *refname;
+	size_t linesiz = 0;
+	ssize_t linelen;
+
+	updatehead = updaterefs = updatetags = 0;
+
+	/* the branch of HEAD, a detached HEAD is not updated by a push */
+	if (!git_reference_lookup(&ref, repo, "HEAD") &&
+	    git_reference_type(ref) == GIT_REF_SYMBOLIC)
+		headname = git_reference_symbolic_target(ref);
+
+	while ((linelen = getline(&line, &linesiz, stdin)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		/* skip the old and new object id */
+		if (!(p = strchr(line, ' ')) || !(refname = strchr(p + 1, ' ')))
+			continue;
+		refname++;
+
+		if (headname && !strcmp(refname, headname))
+			updatehead = 1;
+		if (!strncmp(refname, "refs/heads/", strlen("refs/heads/")))
+			updaterefs = 1;
+		if (!strncmp(refname, "refs/tags/", strlen("refs/tags/")))
+			updaterefs = updatetags = 1;
+	}
+	if (ferror(stdin))
+		err(1, "getline");
+	free(line);
+	git_reference_free(ref);
+}
+
+/* pages of the verification: the path relative to the output directory */
+struct verifypage {
+	char *path;
+	int status; /* VerifySame, VerifyStale or VerifyMissing */
+};
+
+enum { VerifySame, VerifyStale, VerifyMissing };
+
+struct verifyjobs {
+	struct verifypage *pages;
+	size_t n;
+	size_t next; /* next page to compare */
+	pthread_mutex_t lock;
+};
+
+int
+verifypage_cmp(const void *v1, const void *v2)
+{
+	return strcmp(((const struct verifypage *)v1)->path,
+	              ((const struct verifypage *)v2)->path);
+}
+
+/* is the file at path not a page: the cache files, the report and the
+   index of the blames, of which the commits are the ones of the runs that
+   blamed */
+int
+verifyskip(const char *path)
+{
+	size_t len;
+
+	if (!strcmp(path, "blame.txt"))
+		return 1;
+	if (verifyreport && !strcmp(path, verifyreport))
+		return 1;
+	if (!verifycache)
+		return 0;
+	len = strlen(verifycache);
+	return !strncmp(path, verifycache, len) &&
+	       (path[len] == '\0' || path[len] == '.');
+}
+
+/* is the page written to the current directory also with -a: the archives
+   of the tags (-z) */
+int
+verifyoutside(const char *path)
+{
+	return verifyarchive && !strncmp(path, "archives/", strlen("archives/"));
+}
+
+/* add the regular files below dir to pages, the scratch directory and the
+   cache files are skipped */
+void
+verifylist(const char *dir, const char *rel, const struct stat *scratch,
+           struct verifypage **pages, size_t *n, size_t *cap)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+	char path[PATH_MAX], relname[PATH_MAX];
+
+	if (!(dp = opendir(dir)))
+		err(1, "opendir: '%s'", dir);
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		joinpath(path, sizeof(path), dir, d->d_name);
+		joinpath(relname, sizeof(relname), rel, d->d_name);
+		if (lstat(path, &st) == -1)
+			err(1, "lstat: '%s'", path);
+		if (S_ISDIR(st.st_mode)) {
+			if (!scratch || st.st_dev != scratch->st_dev ||
+			    st.st_ino != scratch->st_ino)
+				verifylist(path, relname, scratch, pages, n, cap);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) || verifyskip(relname))
+			continue;
+		if (*n == *cap) {
+			*cap = *cap ? *cap * 2 : 1024;
+			if (!(*pages = reallocarray(*pages, *cap, sizeof(**pages))))
+				err(1, "realloc");
+		}
+		(*pages)[*n].status = VerifySame;
+		if (!((*pages)[(*n)++].path = strdup(relname)))
+			err(1, "strdup");
+	}
+	closedir(dp);
+}
+
+/* compare a page of the scratch directory with the existing page */
+int
+verifycompare(const char *page)
+{
+	struct stat st;
+	char path[PATH_MAX], *buf;
+	int fd, same, outside;
+
+	outside = verifyoutside(page);
+	if (outside ? access(page, F_OK) == -1 : !outexists(page))
+		return VerifyMissing;
+	joinpath(path, sizeof(path), verifydir, page);
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		err(1, "open: '%s'", path);
+	if (!(buf = malloc(st.st_size ? st.st_size : 1)))
+		err(1, "malloc");
+	if (readall(fd, buf, st.st_size) != st.st_size)
+		err(1, "read: '%s'", path);
+	close(fd);
+	if (outside)
+		same = filesamecontent(page, buf, st.st_size);
+	else
+		same = samecontent(page, buf, st.st_size);
+	free(buf);
+
+	return same ? VerifySame : VerifyStale;
+}
+
+void *
+verify_worker(void *arg)
+{
+	struct verifyjobs *vj = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&(vj->lock));
+		i = vj->next++;
+		pthread_mutex_unlock(&(vj->lock));
+		if (i >= vj->n)
+			break;
+		vj->pages[i].status = verifycompare(vj->pages[i].path);
+	}
+
+	return NULL;
+}
+
+/* compare the pages of the full run in the scratch directory with the
+   existing pages in parallel and report the stale, missing and orphaned
+   pages. returns the number of differences. */
+size_t
+verify(void)
+{
+	struct verifyjobs vj;
+	struct verifypage *old = NULL, key;
+	struct stat scratch;
+	pthread_t *threads;
+	size_t nold = 0, cap = 0, nstale = 0, nmissing = 0, norphans = 0, i;
+	long n, t;
+	int r;
+
+	memset(&vj, 0, sizeof(vj));
+	verifylist(verifydir, "", NULL, &(vj.pages), &(vj.n), &cap);
+	qsort(vj.pages, vj.n, sizeof(*vj.pages), verifypage_cmp);
+
+	/* the existing pages */
+	if (chdir(verifyroot) == -1)
+		err(1, "chdir: '%s'", verifyroot);
+	if (verifyarchive) {
+		archive = verifyarchive;
+		pack_open();
+		for (i = 0; i < packindex.cap; i++) {
+			if (!packindex.entries[i].key ||
+			    verifyskip(packindex.entries[i].key))
+				continue;
+			if (!(old = reallocarray(old, nold + 1, sizeof(*old))))
+				err(1, "realloc");
+			if (!(old[nold++].path = strdup(packindex.entries[i].key)))
+				err(1, "strdup");
+		}
+		cap = nold;
+		if (stat("archives", &scratch) == 0 && S_ISDIR(scratch.st_mode))
+			verifylist("archives", "archives", NULL, &old, &nold, &cap);
+	} else {
+		if (stat(verifydir, &scratch) == -1)
+			err(1, "stat: '%s'", verifydir);
+		cap = 0;
+		verifylist(".", "", &scratch, &old, &nold, &cap);
+	}
+
+	n = nthreads();
+	if (!(threads = reallocarray(NULL, n, sizeof(*threads))))
+		err(1, "reallocarray");
+	pthread_mutex_init(&(vj.lock), NULL);
+	/* the main thread compares too */
+	for (t = 0; t + 1 < n && (size_t)t + 1 < vj.n; t++) {
+		if ((r = pthread_create(&threads[t], NULL, verify_worker, &vj))) {
+			errno = r;
+			err(1, "pthread_create");
+		}
+	}
+	verify_worker(&vj);
+	while (t > 0)
+		pthread_join(threads[--t], NULL);
+	pthread_mutex_destroy(&(vj.lock));
+
+	for (i = 0; i < vj.n; i++) {
+		if (vj.pages[i].status == VerifyStale) {
+			printf("stale: %s\n", vj.pages[i].path);
+			nstale++;
+		} else if (vj.pages[i].status == VerifyMissing) {
+			printf("missing: %s\n", vj.pages[i].path);
+			nmissing++;
+		}
+	}
+	qsort(old, nold, sizeof(*old), verifypage_cmp);
+	for (i = 0; i < nold; i++) {
+		key.path = old[i].path;
+		if (bsearch(&key, vj.pages, vj.n, sizeof(*vj.pages), verifypage_cmp))
+			continue;
+		printf("orphaned: %s\n", old[i].path);
+		norphans++;
+	}
+	fflush(stdout);
+	if (verbose)
+		fprintf(stderr, "%zu pages: %zu stale, %zu missing, %zu orphaned\n",
+		        vj.n, nstale, nmissing, norphans);
+
+	for (i = 0; i < vj.n; i++)
+		free(vj.pages[i].path);
+	free(vj.pages);
+	for (i = 0; i < nold; i++)
+		free(old[i].path);
+	free(old);
+	free(threads);
+
+	return nstale + nmissing + norphans;
+}
+
 void
 usage(char *argv0)
 {
-	fprintf(stderr, "%s [-c cachefile | -l commits] repodir\n", argv0);
+	fprintf(stderr, "%s [-c cachefile | -l commits] [-a archive] [-b pattern] "
+	        "[-A] [-B] [-H] [-S] [-T] [-o name=value] [-r reportfile] [-u] [-v] "
+	        "[-V scratchdir] [-z] repodir\n", argv0);
 	exit(1);
 }
 
+/* set a tunable from a "name=value" string, returns -1 on error */
+int
+settunable(const char *s)
+{
+	const char *v;
+	char *p;
+	long long n;
+	size_t i;
+
+	if (!(v = strchr(s, '=')))
+		return -1;
+	for (i = 0; i < sizeof(tunables) / sizeof(*tunables); i++) {
+		if (strlen(tunables[i].name) != (size_t)(v - s) ||
+		    strncmp(tunables[i].name, s, v - s))
+			continue;
+		v++;
+		if (tunables[i].value == &renames && !strcmp(v, "exact")) {
+			renames = -1;
+			return 0;
+		}
+		errno = 0;
+		n = strtoll(v, &p, 10);
+		if (*v == '\0' || *p != '\0' || n < 0 || errno ||
+		    (tunables[i].value == &renames && n > 100))
+			return -1;
+		*(tunables[i].value) = n;
+		return 0;
+	}
+
+	return -1;
+}
+
 int
 main(int argc, char *argv[])
 {
+	struct output *o;
 	git_object *obj = NULL;
 	const git_oid *head = NULL;
 	mode_t mask;
 	FILE *fp, *fpread;
 	char path[PATH_MAX], repodirabs[PATH_MAX + 1], *p;
 	char tmppath[64] = "cache.XXXXXXXXXXXX", buf[BUFSIZ];
+	char histtmppath[64] = "files.XXXXXXXXXXXX";
+	long long logcommits;
 	size_t n;
-	int i, fd;
+	size_t drift = 0;
+	int i, fd, r;
 
 	for (i = 1; i < argc; i++) {
 		if (argv[i][0] != '-') {
@@ -1153,6 +6573,44 @@ main(int argc, char *argv[])
 			if (argv[i][0] == '\0' || *p != '\0' ||
 			    nlogcommits <= 0 || errno)
 				usage(argv[0]);
+		} else if (argv[i][1] == 'a') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			archive = argv[++i];
+		} else if (argv[i][1] == 'b') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			if (!(branchglobs = reallocarray(branchglobs, nbranchglobs + 1,
+			                                 sizeof(*branchglobs))))
+				err(1, "realloc");
+			branchglobs[nbranchglobs++] = argv[++i];
+		} else if (argv[i][1] == 'A') {
+			statspage = 1;
+		} else if (argv[i][1] == 'B') {
+			blamepages = 1;
+		} else if (argv[i][1] == 'H') {
+			filehistory = 1;
+		} else if (argv[i][1] == 'S') {
+			searchindex = 1;
+		} else if (argv[i][1] == 'r') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			reportfile = argv[++i];
+		} else if (argv[i][1] == 'T') {
+			treepages = 1;
+		} else if (argv[i][1] == 'o') {
+			if (i + 1 >= argc || settunable(argv[++i]) == -1)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'u') {
+			refupdates = 1;
+		} else if (argv[i][1] == 'v') {
+			verbose = 1;
+		} else if (argv[i][1] == 'z') {
+			tarballs = 1;
+		} else if (argv[i][1] == 'V') {
+			if (i + 1 >= argc ||
+			    strlcpy(verifydir, argv[++i], sizeof(verifydir)) >= sizeof(verifydir))
+				usage(argv[0]);
 		}
 	}
 	if (!repodir)
@@ -1161,6 +6619,59 @@ main(int argc, char *argv[])
 	if (!realpath(repodir, repodirabs))
 		err(1, "realpath");
 
+	/* verification: a full run without the cache, archive and updated refs
+	   into an empty scratch directory */
+	if (verifydir[0]) {
+		if (!getcwd(verifyroot, sizeof(verifyroot)))
+			err(1, "getcwd");
+		if (mkdir(verifydir, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
+			err(1, "mkdir: '%s'", verifydir);
+		if (!realpath(verifydir, path) ||
+		    strlcpy(verifydir, path, sizeof(verifydir)) >= sizeof(verifydir))
+			err(1, "realpath: '%s'", verifydir);
+		if ((verifycache = cachefile))
+			while (!strncmp(verifycache, "./", 2))
+				verifycache += 2;
+		/* the report is written to the current directory after the
+		   comparison */
+		if ((verifyreport = reportfile)) {
+			n = strlen(verifyroot);
+			if (!strncmp(verifyreport, verifyroot, n) &&
+			    verifyreport[n] == '/')
+				verifyreport += n + 1;
+			while (!strncmp(verifyreport, "./", 2))
+				verifyreport += 2;
+		}
+		verifyarchive = archive;
+		cachefile = NULL;
+		archive = NULL;
+		refupdates = 0;
+		/* the commit pages are written in parallel */
+		deferpages = 1;
+	}
+
+	/* the index of the file history is stored next to the cache */
+	if (cachefile && filehistory) {
+		r = snprintf(histfile, sizeof(histfile), "%s.files", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(histfile))
+			errx(1, "path truncated: '%s.files'", cachefile);
+	}
+	/* the statistics are stored next to the cache */
+	if (cachefile && statspage) {
+		r = snprintf(statsfile, sizeof(statsfile), "%s.stats", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(statsfile))
+			errx(1, "path truncated: '%s.stats'", cachefile);
+	}
+	/* the first-parent chain of HEAD is stored next to the cache */
+	if (cachefile) {
+		r = snprintf(chainfile, sizeof(chainfile), "%s.chain", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(chainfile))
+			errx(1, "path truncated: '%s.chain'", cachefile);
+	}
+
+	umask((mask = umask(0)));
+	outmode = (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask;
+
 	git_libgit2_init();
 
 #ifdef __OpenBSD__
@@ -1170,14 +6681,33 @@ main(int argc, char *argv[])
 		err(1, "unveil: .");
 	if (cachefile && unveil(cachefile, "rwc") == -1)
 		err(1, "unveil: %s", cachefile);
-
-	if (cachefile) {
-		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (pledge("stdio rpath wpath cpath", NULL) == -1)
-			err(1, "pledge");
+	if (histfile[0] && unveil(histfile, "rwc") == -1)
+		err(1, "unveil: %s", histfile);
+	if (statsfile[0] && unveil(statsfile, "rwc") == -1)
+		err(1, "unveil: %s", statsfile);
+	if (chainfile[0] && unveil(chainfile, "rwc") == -1)
+		err(1, "unveil: %s", chainfile);
+	if (reportfile && unveil(reportfile, "rwc") == -1)
+		err(1, "unveil: %s", reportfile);
+	if (verifydir[0] && unveil(verifydir, "rwc") == -1)
+		err(1, "unveil: %s", verifydir);
+	if (cachefile && nbranchglobs) {
+		r = snprintf(path, sizeof(path), "%s.branches", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: '%s.branches'", cachefile);
+		if (unveil(path, "rwc") == -1)
+			err(1, "unveil: %s", path);
 	}
+	/* the index, data files and their temporary files */
+	if (archive) {
+		if (strlcpy(path, archive, sizeof(path)) >= sizeof(path))
+			errx(1, "path truncated: '%s'", archive);
+		if (unveil(dirname(path), "rwc") == -1)
+			err(1, "unveil: %s", path);
+	}
+
+	if (pledge("stdio rpath wpath cpath fattr proc", NULL) == -1)
+		err(1, "pledge");
 #endif
 
 	if (git_repository_open_ext(&repo, repodir,
@@ -1186,6 +6716,13 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (verifydir[0] && chdir(verifydir) == -1)
+		err(1, "chdir: '%s'", verifydir);
+
+	/* all pages are written to the archive */
+	if (archive)
+		pack_open();
+
 	/* find HEAD */
 	if (!git_revparse_single(&obj, repo, "HEAD"))
 		head = git_object_id(obj);
@@ -1250,97 +6787,228 @@ main(int argc, char *argv[])
 		submodules = ".gitmodules";
 	git_object_free(obj);
 
-	/* log for HEAD */
-	fp = efopen("log.html", "w");
-	relpath = "";
-	mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
-	writeheader(fp, "Log");
-	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
-	      "<td><b>Commit message</b></td>"
-	      "<td><b>Author</b></td><td class=\"num\" align=\"right\"><b>Files</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>+</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+	/* with -u only the outputs of the updated refs are written */
+	if (refupdates)
+		readrefupdates();
 
-	if (cachefile && head) {
-		/* read from cache file (does not need to exist) */
-		if ((rcachefp = fopen(cachefile, "r"))) {
-			if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
-				errx(1, "%s: no object id", cachefile);
-			if (git_oid_fromstr(&lastoid, lastoidstr))
-				errx(1, "%s: invalid object id", cachefile);
-		}
+	/* the limit of the log of HEAD is also used for the logs of branches */
+	logcommits = nlogcommits;
 
-		/* write log to (temporary) cache */
-		if ((fd = mkstemp(tmppath)) == -1)
-			err(1, "mkstemp");
-		if (!(wcachefp = fdopen(fd, "w")))
-			err(1, "fdopen: '%s'", tmppath);
-		/* write last commit id (HEAD) */
-		git_oid_tostr(buf, sizeof(buf), head);
-		fprintf(wcachefp, "%s\n", buf);
-
-		writelog(fp, head);
-
-		if (rcachefp) {
-			/* append previous log to log.html and the new cache */
-			while (!feof(rcachefp)) {
-				n = fread(buf, 1, sizeof(buf), rcachefp);
-				if (ferror(rcachefp))
-					err(1, "fread");
-				if (fwrite(buf, 1, n, fp) != n ||
-				    fwrite(buf, 1, n, wcachefp) != n)
-					err(1, "fwrite");
+	/* existing commit pages, shared by all logs */
+	outmkdir("commit");
+	readcommitpages(&commitpages, "commit");
+	commitkey = commitpagekey();
+	commitmanifest_read();
+
+	if (updatehead) {
+		/* log for HEAD */
+		o = outopen("log.html");
+		fp = o->fp;
+		relpath = "";
+		writeheader(fp, "Log");
+		writeloghead(fp);
+
+		if (cachefile && head) {
+			if (filehistory) {
+				rhistfp = fopen(histfile, "r");
+
+				if ((fd = mkstemp(histtmppath)) == -1)
+					err(1, "mkstemp");
+				if (!(whistfp = fdopen(fd, "w")))
+					err(1, "fdopen: '%s'", histtmppath);
+			}
+
+			/* read from cache file (does not need to exist) */
+			if ((rcachefp = fopen(cachefile, "r"))) {
+				if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
+					errx(1, "%s: no object id", cachefile);
+				if (git_oid_fromstr(&lastoid, lastoidstr))
+					errx(1, "%s: invalid object id", cachefile);
+			}
+			/* the last commit of the cache has to be on the first-parent
+			   chain of HEAD, else the history was rewritten. the log
+			   has the commits of the chain after it. */
+			chain_open();
+			chain_update(head);
+			if (rcachefp && chain_log(&lastoid) < 0) {
+				if (verbose)
+					fprintf(stderr, "%s: the history was rewritten, "
+					        "all commits are processed\n", cachefile);
+				fclose(rcachefp);
+				rcachefp = NULL;
+				memset(&lastoid, 0, sizeof(lastoid));
+			}
+			/* without the file history, search index or statistics of
+			   the last run all commits have to be walked */
+			if (rcachefp && ((filehistory && !rhistfp) ||
+			    (searchindex && search_readindex(&lastoid) == -1) ||
+			    (statspage && stats_read(&lastoid) == -1))) {
+				fclose(rcachefp);
+				rcachefp = NULL;
+				memset(&lastoid, 0, sizeof(lastoid));
+			}
+			if (!rcachefp && rhistfp) {
+				fclose(rhistfp);
+				rhistfp = NULL;
 			}
-			fclose(rcachefp);
+			if (!rcachefp)
+				chain_log(NULL);
+
+			/* write log to (temporary) cache */
+			if ((fd = mkstemp(tmppath)) == -1)
+				err(1, "mkstemp");
+			if (!(wcachefp = fdopen(fd, "w")))
+				err(1, "fdopen: '%s'", tmppath);
+			/* write last commit id (HEAD) */
+			git_oid_tostr(buf, sizeof(buf), head);
+			fprintf(wcachefp, "%s\n", buf);
+
+			writelog(fp, head);
+
+			if (rcachefp) {
+				/* append previous log to log.html and the new cache */
+				while (!feof(rcachefp)) {
+					n = fread(buf, 1, sizeof(buf), rcachefp);
+					if (ferror(rcachefp))
+						err(1, "fread");
+					if (fwrite(buf, 1, n, fp) != n ||
+					    fwrite(buf, 1, n, wcachefp) != n)
+						err(1, "fwrite");
+				}
+				fclose(rcachefp);
+			}
+			fclose(wcachefp);
+
+			if (rhistfp) {
+				filehistory_read(rhistfp);
+				fclose(rhistfp);
+			}
+			if (whistfp && fclose(whistfp))
+				err(1, "fclose: '%s'", histtmppath);
+		} else {
+			if (head)
+				writelog(fp, head);
 		}
-		fclose(wcachefp);
-	} else {
+
+		fputs("</tbody></table>", fp);
+		writefooter(fp);
+		outclose(o);
+
+		/* files for HEAD */
+		o = outopen("files.html");
+		writeheader(o->fp, "Files");
 		if (head)
-			writelog(fp, head);
+			writefiles(o->fp, head);
+		writefooter(o->fp);
+		outclose(o);
+
+		/* blame per file, only of files changed since the last run */
+		if (blamepages && head)
+			writeblames(head);
+
+		/* history per file, only of changed files when using the cache */
+		if (filehistory)
+			writehistory(head, !rcachefp);
+
+		/* search index, only the new commits are added when using the cache */
+		if (searchindex && head) {
+			git_oid_tostr(buf, sizeof(buf), head);
+			search_write(rcachefp != NULL, buf);
+		}
+
+		/* statistics, of the new commits added to the ones of the cache */
+		if (statspage) {
+			o = outopen("stats.html");
+			writeheader(o->fp, "Stats");
+			writestats(o->fp);
+			writefooter(o->fp);
+			outclose(o);
+		}
 	}
 
-	fputs("</tbody></table>", fp);
-	writefooter(fp);
-	fclose(fp);
+	/* logs of branches, sharing the commit pages */
+	if (updaterefs && nbranchglobs)
+		writebranchlogs(logcommits);
 
-	/* files for HEAD */
-	fp = efopen("files.html", "w");
-	writeheader(fp, "Files");
-	if (head)
-		writefiles(fp, head);
-	writefooter(fp);
-	fclose(fp);
+	/* commit pages of which the header or limits changed */
+	writestalecommits();
+	commitmanifest_write();
+
+	if (verbose && updatehead)
+		writeorphans();
 
 	/* summary page with branches and tags */
-	fp = efopen("refs.html", "w");
-	writeheader(fp, "Refs");
-	writerefs(fp);
-	writefooter(fp);
-	fclose(fp);
+	if (updaterefs) {
+		o = outopen("refs.html");
+		writeheader(o->fp, "Refs");
+		writerefs(o->fp);
+		writefooter(o->fp);
+		outclose(o);
+	}
 
 	/* Atom feed */
-	fp = efopen("atom.xml", "w");
-	writeatom(fp, 1);
-	fclose(fp);
+	if (updatehead) {
+		o = outopen("atom.xml");
+		writeatom(o->fp, 1);
+		outclose(o);
+	}
 
 	/* Atom feed for tags / releases */
-	fp = efopen("tags.xml", "w");
-	writeatom(fp, 0);
-	fclose(fp);
+	if (updatetags) {
+		o = outopen("tags.xml");
+		writeatom(o->fp, 0);
+		outclose(o);
+	}
+
+	/* wait until all pages are written */
+	outflush();
+	if (archive)
+		pack_close();
+
+	/* compare them with the existing pages */
+	if (verifydir[0])
+		drift = verify();
 
 	/* rename new cache file on success */
-	if (cachefile && head) {
+	if (cachefile && head && updatehead) {
+		chain_write();
 		if (rename(tmppath, cachefile))
 			err(1, "rename: '%s' to '%s'", tmppath, cachefile);
-		umask((mask = umask(0)));
-		if (chmod(cachefile,
-		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+		if (chmod(cachefile, outmode))
 			err(1, "chmod: '%s'", cachefile);
+		if (filehistory) {
+			if (rename(histtmppath, histfile))
+				err(1, "rename: '%s' to '%s'", histtmppath, histfile);
+			if (chmod(histfile, outmode))
+				err(1, "chmod: '%s'", histfile);
+		}
+		if (statspage) {
+			git_oid_tostr(buf, sizeof(buf), head);
+			stats_write(buf);
+		}
 	}
 
+	if (verbose) {
+		fprintf(stderr, "%zu of %zu files changed\n", noutchanged, noutfiles);
+		fprintf(stderr, "%zu commits: %zu diffstat allocations (at most %zu per commit), "
+		        "%zu from the heap\n", arenacommits, arenaallocs,
+		        arenamaxallocs, arenaheap);
+	}
+
+	if (reportfile)
+		writereport();
+
 	/* cleanup */
+	objcache_free();
+	filehistory_free();
+	stats_free();
+	search_free();
+	oidset_free(&commitpages);
+	oidset_free(&chainpos);
+	free(chainnew);
+	free(chainlog);
 	git_repository_free(repo);
 	git_libgit2_shutdown();
 
-	return 0;
+	return drift != 0;
 }